@@ -0,0 +1,122 @@
+// Animated sketches from a sequence of pgm files, used with
+// './converter --animate frame*.pgm --fps n', which writes frame.sk.
+// -----------------------------------------------------------------
+// Every frame of the animation is a frame of the sketch, ended by a NEXTFRAME.
+// The viewer clears the canvas whenever it shows it, and a sketch cannot refer
+// back to earlier bytes, so a frame cannot be drawn as the pixels that changed
+// since the frame before: every frame that differs from the one before is drawn
+// in full by the run encoder. A frame equal to the one before costs nothing,
+// the frame before is held on screen for longer instead.
+//
+// Timing: a shown frame stays on screen for the pauses until the next show,
+// plus the wait of the show itself. So every frame starts with the PAUSE of the
+// frame shown before it, and the first frame with that of the last, since the
+// viewer loops. Frame k is due at 1000 k / fps ms, so rounding never drifts.
+#include "converter.h"
+
+// the pause that holds a frame on screen from start to end ms
+static void holdFrame(image *thisImage, unsigned long start, unsigned long end) {
+  if (end - start <= SHOW_DELAY) return;
+  setData(thisImage, end - start - SHOW_DELAY);
+  putByte(thisImage, PAUSE_ins);
+}
+
+// the animated sk file of n frames of grays, all of the size of the image
+// returns the number of frames drawn, once the equal ones are merged
+int animatePGM(image *thisImage, unsigned char **frames, int n, int fps) {
+  unsigned long pixels = (unsigned long) thisImage->width * thisImage->height;
+  unsigned long *due = malloc((n + 1) * sizeof(unsigned long));
+  int *first = malloc((n + 1) * sizeof(int)), drawn = 0;
+
+  // the first of every run of equal frames is drawn, until the next is due
+  for (int k = 0; k <= n; k++) due[k] = (1000UL * k + fps / 2) / fps;
+  for (int k = 0; k < n; k++)
+    if (k == 0 || memcmp(frames[k], frames[k - 1], pixels) != 0) first[drawn++] = k;
+  first[drawn] = n;
+
+  if (thisImage->width != DEFAULT_WIDTH || thisImage->height != DEFAULT_HEIGHT) setCanvas(thisImage);
+  for (int k = 0; k < drawn; k++) {
+    if (k > 0) putByte(thisImage, NEXTFRAME_ins);
+    if (k == 0) holdFrame(thisImage, due[first[drawn - 1]], due[n]);
+    else holdFrame(thisImage, due[first[k - 1]], due[first[k]]);
+    processBand(thisImage, frames[first[k]], 0, thisImage->width);
+  }
+  free(due);
+  free(first);
+  return drawn;
+}
+
+// the name of the animation: the first frame without its number and extension
+static char *animationName(char *filename) {
+  char *output = outputName(filename, ".pgm", ".sk");
+  size_t end;
+
+  if (output == NULL) return NULL;
+  end = strlen(output) - 3;
+  while (end > 1 && (isdigit(output[end - 1]) || output[end - 1] == '-' || output[end - 1] == '_')) end--;
+  strcpy(output + end, ".sk");
+  return output;
+}
+
+// read every pgm file into inputs, with the grays of each in frames and
+// the size of them all in pgm
+static bool readFrames(char **filenames, int n, unsigned char **inputs, unsigned char **frames,
+                       image *pgm, unsigned long *total, options *opts) {
+  for (int k = 0; k < n; k++) {
+    FILE *fp = fopen(filenames[k], "rb");
+    unsigned long length;
+    int width = pgm->width, height = pgm->height;
+
+    if (fp == NULL) { fprintf(stderr, "Error: Cannot read image %s.\n", filenames[k]); return false; }
+    inputs[k] = readFile(fp, &length);
+    *total += length;
+    if (!verifyPGM(inputs[k], length, pgm)) { fprintf(stderr, "Error: Corrupted PGM file %s.\n", filenames[k]); return false; }
+    if (k > 0 && (pgm->width != width || pgm->height != height)) {
+      fprintf(stderr, "Error: %s is not %dx%d like the frames before.\n", filenames[k], width, height);
+      return false;
+    }
+    if (opts->colours > 0 || opts->tolerance > 0)
+      quantize(pgm->bytes, (unsigned long) pgm->width * pgm->height, opts->colours, opts->tolerance);
+    frames[k] = pgm->bytes;
+  }
+  return true;
+}
+
+// read every pgm file and write them as the frames of one sk file
+bool animate(char **filenames, int n, int fps, options *opts) {
+  unsigned char **inputs = calloc(n, sizeof(unsigned char *)), **frames = malloc(n * sizeof(unsigned char *));
+  char *output = animationName(filenames[0]);
+  FILE *ofp = NULL, *log = opts->toStdout ? stderr : stdout;
+  unsigned long total = 0;
+  image pgm = {0};
+  bool done = false;
+
+  if (output == NULL) fprintf(stderr, "Error: incorrect filetype %s.\n", filenames[0]);
+  else if (fps <= 0) fprintf(stderr, "Error: the frame rate must be positive.\n");
+  else if (readFrames(filenames, n, inputs, frames, &pgm, &total, opts)) {
+    ofp = opts->toStdout ? stdout : fopen(output, "wb");
+    if (ofp == NULL) fprintf(stderr, "Error: Cannot write image %s.\n", output);
+  }
+
+  if (ofp != NULL) {
+    image *thisImage = newSKStream(pgm.width, pgm.height, ofp);
+    if (opts->stats) thisImage->stats = newStats();
+    thisImage->palette = opts->palette;
+    int drawn = animatePGM(thisImage, frames, n, fps);
+    flushSK(thisImage);
+    if (!opts->quiet) fprintf(log, "%d frames, %d drawn, in %lu bytes.\n", n, drawn, thisImage->written);
+    if (thisImage->stats) {
+      printStats(thisImage->stats, log, total, pgm.width, pgm.height);
+      freeStats(thisImage->stats);
+    }
+    if (ofp != stdout) fclose(ofp);
+    free(thisImage->bytes);
+    free(thisImage);
+    done = true;
+  }
+  for (int k = 0; k < n; k++) free(inputs[k]);
+  free(inputs);
+  free(frames);
+  free(output);
+  return done;
+}
@@ -0,0 +1,189 @@
+// Parallel conversion of many files, and of large images in bands.
+// -----------------------------------------------------------------
+// Batch conversion: './converter --batch dir' converts every pgm file of dir to
+// sk, './converter --batch -' converts every pgm or sk file listed on stdin, one
+// path per line. The files are shared out to a pool of threads, one for each
+// core, and every thread takes the next file as soon as it has finished one.
+// Each conversion reports its time and throughput, and the batch reports the
+// totals at the end.
+//
+// Band encoding: './converter --bands n file.pgm' splits the image into n bands
+// of columns, encodes each band on its own thread and joins the bands in order.
+// Each band moves to its first column absolutely, so the joined file decodes to
+// the same image.
+#define _POSIX_C_SOURCE 200809L // dirent, pthreads, clock_gettime, sysconf, getline
+#define pause posixPause // unistd.h declares a pause() of its own, unlike the display's
+#include <unistd.h>
+#undef pause
+#include "converter.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+// the files of a batch and the progress through them
+typedef struct job {
+  char **files;
+  int count, capacity, next, failed;
+  unsigned long read, written;
+  options *opts; // the options of every conversion, which are quiet
+  bool report; // report every conversion and the totals
+  pthread_mutex_t lock;
+} job;
+
+int cores() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : n;
+}
+
+static double now() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void addFile(job *j, char *path) {
+  if (j->count == j->capacity) {
+    j->capacity = j->capacity == 0 ? 64 : 2 * j->capacity;
+    j->files = realloc(j->files, j->capacity * sizeof(char *));
+  }
+  j->files[j->count++] = path;
+}
+
+static int byName(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+// the pgm files of directory dir, by name
+// sk files are left out, as they may be the outputs of the pgm files
+static bool listDirectory(job *j, char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  bool slash = dir[strlen(dir) - 1] == '/';
+
+  if (d == NULL) { fprintf(stderr, "Error: Cannot read directory %s.\n", dir); return false; }
+  while ((entry = readdir(d)) != NULL) {
+    size_t n = strlen(entry->d_name);
+    if (n <= 4 || strcmp(entry->d_name + n - 4, ".pgm") != 0) continue;
+    char *path = malloc(strlen(dir) + n + 2);
+    sprintf(path, "%s%s%s", dir, slash ? "" : "/", entry->d_name);
+    addFile(j, path);
+  }
+  closedir(d);
+  qsort(j->files, j->count, sizeof(char *), byName);
+  return true;
+}
+
+// the files listed on stdin, skipping empty lines
+static void listStdin(job *j) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t n;
+
+  while ((n = getline(&line, &size, stdin)) > 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+    if (n > 0) addFile(j, strdup(line));
+  }
+  free(line);
+}
+
+// convert files until none are left
+static void *worker(void *data) {
+  job *j = data;
+
+  while (true) {
+    unsigned long sizes[2] = {0, 0};
+    pthread_mutex_lock(&j->lock);
+    int i = j->next++;
+    pthread_mutex_unlock(&j->lock);
+    if (i >= j->count) return NULL;
+
+    double start = now();
+    bool done = solve(j->files[i], j->opts, sizes);
+    double seconds = now() - start;
+
+    pthread_mutex_lock(&j->lock);
+    if (!done) j->failed++;
+    else {
+      j->read += sizes[0];
+      j->written += sizes[1];
+      if (j->report) printf("%s: %lu -> %lu bytes in %.1f ms, %.1f MB/s\n", j->files[i],
+        sizes[0], sizes[1], 1000 * seconds, sizes[0] / 1e6 / (seconds > 0 ? seconds : 1e-9));
+    }
+    pthread_mutex_unlock(&j->lock);
+  }
+}
+
+// convert the files of a directory, or those listed on stdin for -
+// the files themselves are converted quietly, the batch reports them
+bool batch(char *source, options *opts) {
+  options each = *opts;
+  job j = {NULL, 0, 0, 0, 0, 0, 0, &each, !opts->quiet};
+  int threads = cores();
+  pthread_t *pool;
+  double start = now(), seconds;
+
+  each.quiet = true;
+  each.stats = false;
+  if (strcmp(source, "-") == 0) listStdin(&j);
+  else if (!listDirectory(&j, source)) return false;
+  if (threads > j.count) threads = j.count > 0 ? j.count : 1;
+
+  pthread_mutex_init(&j.lock, NULL);
+  pool = malloc(threads * sizeof(pthread_t));
+  for (int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, worker, &j);
+  for (int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+  seconds = now() - start;
+
+  if (j.report) printf("%d files, %d failed, in %.2f s with %d threads: %.1f files/s, %.1f MB/s read, %.1f MB/s written\n",
+    j.count, j.failed, seconds, threads, (j.count - j.failed) / seconds, j.read / 1e6 / seconds, j.written / 1e6 / seconds);
+  pthread_mutex_destroy(&j.lock);
+  for (int i = 0; i < j.count; i++) free(j.files[i]);
+  free(j.files);
+  free(pool);
+  return j.failed == 0;
+}
+
+// ---------------------------------------------------------
+
+// a band of columns and the sk bytes it is encoded into
+typedef struct band {
+  image *sk;
+  unsigned char *input;
+  int x0, x1;
+} band;
+
+static void *encodeBand(void *data) {
+  band *b = data;
+
+  processBand(b->sk, b->input, b->x0, b->x1);
+  return NULL;
+}
+
+// encode the image in bands of columns of about equal width, each on its own
+// thread into memory, then append them to the sk image in order
+void processBands(image *thisImage, unsigned char *input, int bands) {
+  int width = thisImage->width, height = thisImage->height;
+  band *parts;
+  pthread_t *pool;
+
+  if (bands > width) bands = width;
+  parts = malloc(bands * sizeof(band));
+  pool = malloc(bands * sizeof(pthread_t));
+  for (int k = 0; k < bands; k++) {
+    parts[k] = (band) {newSKImage(width, height), input, (long) width * k / bands, (long) width * (k + 1) / bands};
+    parts[k].sk->palette = thisImage->palette;
+    pthread_create(&pool[k], NULL, encodeBand, &parts[k]);
+  }
+
+  if (width != DEFAULT_WIDTH || height != DEFAULT_HEIGHT) setCanvas(thisImage);
+  for (int k = 0; k < bands; k++) {
+    pthread_join(pool[k], NULL);
+    for (unsigned long i = 0; i < parts[k].sk->size; i++) putByte(thisImage, parts[k].sk->bytes[i]);
+    free(parts[k].sk->bytes);
+    free(parts[k].sk);
+  }
+  free(parts);
+  free(pool);
+}
@@ -0,0 +1,216 @@
+// Benchmarks of the hot paths of the converter and the viewer.
+// -----------------------------------------------------------------
+// Build with 'make bench' (optimised, no sanitizers) and run ./bench. Every
+// input is encoded (verifyPGM, processPGM), its sk bytes decoded (verifySK,
+// processSK) and replayed headless as the viewer plays it (processSketch on the
+// software display, for every frame). The inputs are fractal.pgm, bands.pgm, a
+// generated large banded image, generated noise and the sketchNN.sk files.
+//
+// Each step is repeated for at least a quarter of a second and reports its time
+// per run, MB/s of its input bytes, pixels/s, and the allocations per run. The
+// encoder also reports the sk bytes per pixel. Allocations are counted by
+// wrapping malloc, calloc and realloc at link time (see the Makefile).
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "converter.h"
+#include <time.h>
+
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocations++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocations++;
+  return __real_realloc(p, size);
+}
+
+static double now() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// an input, as the bytes of its pgm and sk files
+typedef struct sample {
+  char *name;
+  unsigned char *pgm, *sk;
+  unsigned long pgmLength, skLength;
+  int width, height, frames;
+} sample;
+
+// the step being timed and the sample it runs on
+typedef struct step {
+  sample *s;
+  unsigned long result; // the output bytes of the last run
+} step;
+
+static void benchVerifyPGM(step *t) {
+  image pgm;
+
+  t->result = verifyPGM(t->s->pgm, t->s->pgmLength, &pgm);
+}
+
+// encode into a stream without a sink, as convert2sk does minus the writes
+static void benchProcessPGM(step *t) {
+  image pgm, *sk;
+
+  verifyPGM(t->s->pgm, t->s->pgmLength, &pgm);
+  sk = newSKStream(pgm.width, pgm.height, NULL);
+  processPGM(sk, pgm.bytes);
+  flushSK(sk);
+  t->result = sk->written;
+  free(sk->bytes);
+  free(sk);
+}
+
+static void benchVerifySK(step *t) {
+  t->result = verifySK(t->s->sk, t->s->skLength);
+}
+
+static void benchProcessSK(step *t) {
+  image *pgm = newPGMImage(t->s->width, t->s->height);
+
+  processSK(pgm, t->s->sk, t->s->skLength);
+  t->result = pgm->size;
+  free(pgm->bytes);
+  free(pgm);
+}
+
+// load the sketch file and play every frame, as the viewer does
+static void benchReplay(step *t) {
+  display *d = newDisplay(t->s->name, t->s->width, t->s->height);
+
+  playFrames(d, t->s->name, t->s->frames);
+  t->result = t->s->frames;
+  freeDisplay(d);
+}
+
+// run a step for at least a quarter of a second and report it
+static void measure(char *label, void run(step *), sample *s, unsigned long bytes) {
+  step t = {s, 0};
+  unsigned long before = allocations, runs = 0;
+  double start = now(), seconds;
+  double pixels = (double) s->width * s->height;
+
+  do {
+    run(&t);
+    runs++;
+  } while ((seconds = now() - start) < 0.25);
+  seconds /= runs;
+  printf("%-14s %-12s %10.3f ms %10.1f MB/s %10.1f Mpixels/s %8.1f allocs", s->name, label,
+    1000 * seconds, bytes / 1e6 / seconds, pixels / 1e6 / seconds, (double) (allocations - before) / runs);
+  if (run == benchProcessPGM) printf(" %8.4f bytes/pixel", t.result / pixels);
+  printf("\n");
+}
+
+static unsigned char *readAll(char *filename, unsigned long *length) {
+  FILE *fp = fopen(filename, "rb");
+
+  if (fp == NULL) { fprintf(stderr, "Error: Cannot read %s.\n", filename); exit(1); }
+  return readFile(fp, length);
+}
+
+// a pgm file of the given grays
+static unsigned char *makePGM(unsigned char *grays, int width, int height, unsigned long *length) {
+  unsigned long n = (unsigned long) width * height;
+  unsigned char *pgm = malloc(n + 32);
+  int header = sprintf((char *) pgm, "P5 %d %d 255\n", width, height);
+
+  memcpy(pgm + header, grays, n);
+  *length = header + n;
+  return pgm;
+}
+
+// encode the pgm bytes of the sample into its sk file, saved as name.sk
+// so that the viewer can load it
+static void encodeSample(sample *s) {
+  image pgm, *sk;
+  FILE *fp;
+
+  if (!verifyPGM(s->pgm, s->pgmLength, &pgm)) { fprintf(stderr, "Error: Corrupted PGM file %s.\n", s->name); exit(1); }
+  s->width = pgm.width;
+  s->height = pgm.height;
+  sk = newSKImage(pgm.width, pgm.height);
+  processPGM(sk, pgm.bytes);
+  s->sk = sk->bytes;
+  s->skLength = sk->size;
+  free(sk);
+  fp = fopen(s->name, "wb");
+  fwrite(s->sk, 1, s->skLength, fp);
+  fclose(fp);
+}
+
+static void benchSample(sample *s) {
+  program *p = decodeSketch(s->sk, s->skLength);
+
+  s->frames = p->nframes;
+  freeProgram(p);
+  if (s->pgm != NULL) {
+    measure("verifyPGM", benchVerifyPGM, s, s->pgmLength);
+    measure("processPGM", benchProcessPGM, s, s->pgmLength);
+  }
+  measure("verifySK", benchVerifySK, s, s->skLength);
+  measure("processSK", benchProcessSK, s, s->skLength);
+  measure("replay", benchReplay, s, s->skLength);
+}
+
+int main() {
+  char *pgms[] = {"fractal", "bands"};
+  sample s;
+
+  for (int k = 0; k < 2; k++) {
+    char name[32], filename[32];
+    sprintf(name, "bench-%s.sk", pgms[k]);
+    sprintf(filename, "%s.pgm", pgms[k]);
+    s = (sample) {name};
+    s.pgm = readAll(filename, &s.pgmLength);
+    encodeSample(&s);
+    benchSample(&s);
+    remove(s.name);
+    free(s.pgm);
+    free(s.sk);
+  }
+
+  // a 4K image of wide bands, and 1000x1000 pixels of noise
+  for (int k = 0; k < 2; k++) {
+    int width = k == 0 ? 3840 : 1000, height = k == 0 ? 2160 : 1000;
+    unsigned char *grays = malloc((unsigned long) width * height);
+    unsigned int seed = 12345;
+    for (int y = 0; y < height; y++)
+      for (int x = 0; x < width; x++) {
+        seed = seed * 1103515245u + 12345u;
+        grays[(long) y * width + x] = k == 0 ? (x / 64 * 16 + y / 270 * 8) % 256 : seed >> 24;
+      }
+    s = (sample) {k == 0 ? "bench-large.sk" : "bench-noise.sk"};
+    s.pgm = makePGM(grays, width, height, &s.pgmLength);
+    encodeSample(&s);
+    benchSample(&s);
+    remove(s.name);
+    free(grays);
+    free(s.pgm);
+    free(s.sk);
+  }
+
+  for (int k = 0; k < 10; k++) {
+    char name[16];
+    sprintf(name, "sketch%02d.sk", k);
+    s = (sample) {name};
+    s.sk = readAll(name, &s.skLength);
+    sketchCanvas(s.sk, s.skLength, &s.width, &s.height);
+    if (verifySK(s.sk, s.skLength)) benchSample(&s);
+    free(s.sk);
+  }
+  return 0;
+}
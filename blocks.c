@@ -0,0 +1,72 @@
+// Rectangle encoder, used with './converter --blocks file.pgm'.
+// -----------------------------------------------------------------
+// Every gray is covered with BLOCK fills only. The grays are drawn in ascending
+// order, so a block of one gray may also cover the pixels of any lighter gray,
+// which is drawn over it later, but never those of a darker one. The first
+// pixel of the gray not yet covered, column by column, is the top left corner
+// of the largest block the gray may fill from there. Flat regions become a few
+// fills, and the viewer replays them with as many block calls. Gray 0 is left
+// to the black canvas.
+#include "converter.h"
+
+// the image being covered with blocks of one gray
+typedef struct layer {
+  unsigned char *input, *covered;
+  unsigned short *right, *down; // lengths of the runs the gray may fill
+  int width, height, gray;
+} layer;
+
+// whether pixel j may be filled along with pixel i: it is not darker than the gray
+static bool fillable(void *data, unsigned long i, unsigned long j) {
+  layer *l = data;
+
+  return l->input[j] >= l->gray;
+}
+
+// mark the pixels of the gray in the block as covered
+static void coverBlock(layer *l, int x, int y, int tx, int ty) {
+  for (int row = y; row < ty; row++)
+    for (int col = x; col < tx; col++) {
+      unsigned long i = (unsigned long) row * l->width + col;
+      l->covered[i] |= l->input[i] == l->gray;
+    }
+}
+
+// the pgm -> sk conversion with blocks only
+void blockPGM(image *thisImage, unsigned char *input) {
+  unsigned long n = (unsigned long) thisImage->width * thisImage->height;
+  layer l = {input, calloc(n, 1), malloc(n * sizeof(unsigned short)), malloc(n * sizeof(unsigned short)),
+    thisImage->width, thisImage->height, 0};
+  spans *r = findRuns(input, l.width, l.height, 0, l.width);
+  state s = {0, 0, 0, 0, 0, 0, LINE};
+
+  if (l.width != DEFAULT_WIDTH || l.height != DEFAULT_HEIGHT) setCanvas(thisImage);
+  for (int gray = 1; gray < 256; gray++) {
+    unsigned long first = r->start[gray], end = r->start[gray + 1];
+    int y0 = l.height, y1 = 0;
+    if (first == end) continue;
+
+    // the gray only needs blocks inside its bounding box
+    for (unsigned long i = first; i < end; i++) {
+      if (r->runs[i].y < y0) y0 = r->runs[i].y;
+      if (r->runs[i].last + 1 > y1) y1 = r->runs[i].last + 1;
+    }
+    l.gray = gray;
+    measureFills(l.right, l.down, l.width, r->runs[first].x, y0, r->runs[end - 1].x + 1, y1, fillable, &l);
+    setColour(thisImage, gray2rgba(gray));
+
+    for (unsigned long i = first; i < end; i++)
+      for (int y = r->runs[i].y; y <= r->runs[i].last; y++) {
+        int x = r->runs[i].x, tx = x + 1, ty = y + 1;
+        if (l.covered[(unsigned long) y * l.width + x]) continue;
+        largestFill(l.right, l.down, l.width, x, y, &tx, &ty);
+        moveTo(thisImage, &s, x, y);
+        blockTo(thisImage, &s, tx, ty);
+        coverBlock(&l, x, y, tx, ty);
+      }
+  }
+  freeRuns(r);
+  free(l.covered);
+  free(l.right);
+  free(l.down);
+}
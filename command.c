@@ -0,0 +1,142 @@
+// Decoding of sketch files (.sk) into a flat sequence of draw commands.
+// Full comments on how to use the module can be found in the header file.
+#include "command.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Operations and tool types of the sketch format
+enum { DX = 0, DY = 1, TOOL = 2, DATA = 3 };
+enum { NONE = 0, LINE = 1, BLOCK = 2, COLOUR = 3, TARGETX = 4, TARGETY = 5,
+       SHOW = 6, PAUSE = 7, NEXTFRAME = 8
+     };
+
+// Drawing state while decoding
+typedef struct decoder { int x, y, tx, ty, tool; unsigned int data; } decoder;
+
+// append a command, growing the array geometrically
+static void emit(program *p, int op, int x, int y, int tx, int ty, unsigned int data) {
+  if (p->size == p->capacity) {
+    p->capacity = p->capacity == 0 ? 64 : 2 * p->capacity;
+    p->commands = realloc(p->commands, p->capacity * sizeof(command));
+  }
+  p->commands[p->size++] = (command) {op, x, y, tx, ty, data};
+}
+
+static void resetDecoder(decoder *s) {
+  *s = (decoder) {0, 0, 0, 0, LINE, 0};
+}
+
+static void decodeTOOL(program *p, decoder *s, byte op) {
+  int operand = getOperand(op);
+
+  switch (operand) {
+    case NONE:
+    case LINE:
+    case BLOCK:
+      s->tool = operand;
+      break;
+    case COLOUR:
+      emit(p, COLOUR_cmd, 0, 0, 0, 0, s->data);
+      break;
+    case TARGETX:
+      s->tx = s->data;
+      break;
+    case TARGETY:
+      s->ty = s->data;
+      break;
+    case SHOW:
+      emit(p, SHOW_cmd, 0, 0, 0, 0, 0);
+      break;
+    case PAUSE:
+      emit(p, PAUSE_cmd, 0, 0, 0, 0, s->data);
+      break;
+    case NEXTFRAME:
+      emit(p, FRAME_cmd, 0, 0, 0, 0, 0);
+      resetDecoder(s);
+      break;
+  }
+  s->data = 0;
+}
+
+static void decodeDY(program *p, decoder *s, byte op) {
+  s->ty += getOperand(op);
+  if (s->tool == LINE) emit(p, LINE_cmd, s->x, s->y, s->tx, s->ty, 0);
+  else if (s->tool == BLOCK) emit(p, BLOCK_cmd, s->x, s->y, s->tx, s->ty, 0);
+  s->x = s->tx;
+  s->y = s->ty;
+}
+
+// count the frames and record where each one starts
+static void indexFrames(program *p) {
+  p->nframes = 1;
+  for (int i = 0; i < p->size; i++)
+    if (p->commands[i].op == FRAME_cmd) p->nframes++;
+
+  p->frames = malloc((p->nframes + 1) * sizeof(int));
+  p->frames[0] = 0;
+  for (int i = 0, n = 1; i < p->size; i++)
+    if (p->commands[i].op == FRAME_cmd) p->frames[n++] = i + 1;
+  p->frames[p->nframes] = p->size;
+}
+
+void sketchCanvas(byte *bytes, unsigned long length, int *width, int *height) {
+  unsigned int size[2] = {0, 0};
+  unsigned long i = 0;
+
+  *width = DEFAULT_WIDTH;
+  *height = DEFAULT_HEIGHT;
+  for (int k = 0; k < 2; k++) {
+    while (i < length && getOpcode(bytes[i]) == DATA) size[k] = (size[k] << 6) | (bytes[i++] & 0x3F);
+    if (i >= length || bytes[i++] != ((TOOL << 6) | (TARGETX + k))) return;
+  }
+  if (i + 2 > length || bytes[i] != ((TOOL << 6) | TARGETX) || bytes[i + 1] != ((TOOL << 6) | TARGETY)) return;
+  if (size[0] == 0 || size[1] == 0 || size[0] > 65535 || size[1] > 65535) return;
+  *width = size[0];
+  *height = size[1];
+}
+
+program *decodeSketch(byte *bytes, unsigned long length) {
+  program *p = malloc(sizeof(program));
+  decoder s;
+
+  *p = (program) {NULL, 0, 0, NULL, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT};
+  sketchCanvas(bytes, length, &p->width, &p->height);
+  resetDecoder(&s);
+  for (unsigned long i = 0; i < length; i++) {
+    byte op = bytes[i];
+
+    switch (getOpcode(op)) {
+      case TOOL:
+        decodeTOOL(p, &s, op);
+        break;
+      case DX:
+        s.tx += getOperand(op);
+        break;
+      case DY:
+        decodeDY(p, &s, op);
+        break;
+      case DATA:
+        s.data = (s.data << 6) | (op & 0x3F);
+        break;
+    }
+  }
+  indexFrames(p);
+  return p;
+}
+
+void freeProgram(program *p) {
+  free(p->commands);
+  free(p->frames);
+  free(p);
+}
+
+int getOpcode(byte b) {
+  return b >> 6;
+}
+
+int getOperand(byte b) {
+  int val = b & 0x3F;
+
+  if (val >> 5) val = val | 0xFFFFFFC0; // extend sign
+  return val;
+}
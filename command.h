@@ -0,0 +1,52 @@
+// Decoding of sketch files (.sk) into a flat sequence of draw commands.
+// -----------------------------------------------------------------------------
+// A sketch file is a stream of single byte instructions whose effect depends on
+// the DATA register, the DX/DY targets and the current tool. decodeSketch folds
+// all of that state away once, leaving commands that can be executed directly
+// (and as often as needed) by the viewer or the converter.
+
+// A byte is defined as an unsigned 8bit value
+typedef unsigned char byte;
+
+// Kinds of decoded commands
+enum { COLOUR_cmd = 0, LINE_cmd = 1, BLOCK_cmd = 2, SHOW_cmd = 3, PAUSE_cmd = 4,
+       FRAME_cmd = 5
+     };
+
+// A single decoded command. LINE_cmd draws from (x,y) to (tx,ty), BLOCK_cmd
+// fills the rectangle at (x,y) of size (tx-x, ty-y). data holds the rgba value
+// of COLOUR_cmd and the milliseconds of PAUSE_cmd. FRAME_cmd marks a NEXTFRAME.
+typedef struct command { int op, x, y, tx, ty; unsigned int data; } command;
+
+// Canvas size of sketch files that do not declare one.
+enum { DEFAULT_WIDTH = 200, DEFAULT_HEIGHT = 200 };
+
+// A decoded sketch file. frames[k] is the index of the first command of
+// frame k; a file with n NEXTFRAME instructions has n + 1 frames and
+// frames[nframes] == size.
+typedef struct program {
+  command *commands;
+  int size, capacity;
+  int *frames, nframes;
+  int width, height;
+} program;
+
+// Decode length bytes of a sketch file. As in the viewer, the drawing state is
+// reset at the start of every frame.
+program *decodeSketch(byte *bytes, unsigned long length);
+
+// A sketch file declares a canvas size other than 200x200 by starting with
+//   DATA(width).. TARGETX DATA(height).. TARGETY TARGETX TARGETY
+// Played as instructions this only sets and then clears the targets, so viewers
+// that do not know the convention draw the file as before. Reads the declared
+// size, or the default size if there is none.
+void sketchCanvas(byte *bytes, unsigned long length, int *width, int *height);
+
+// Release all memory associated with a decoded sketch file.
+void freeProgram(program *p);
+
+// Extract an opcode from a byte (two most significant bits).
+int getOpcode(byte b);
+
+// Extract an operand (-32..31) from the rightmost 6 bits of a byte.
+int getOperand(byte b);
@@ -1,82 +1,7 @@
-#include "displayfull.h"
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdbool.h>
-#include <ctype.h>
-#include <math.h>
-
-#define PGM 1
-#define SK 0
-
-enum { DX = 0, DY = 1, TOOL = 2,
-       DATA = 3,
-       NONE = 0, LINE = 1,
-     BLOCK = 2, COLOUR = 3, TARGETX = 4, TARGETY = 5,
-     };
-
-enum { NONE_ins = 0x80, LINE_ins = 0x81, BLOCK_ins = 0x82, 
-  COLOUR_ins = 0x83, TARGETX_ins = 0x84, TARGETY_ins = 0x85,
-  DATA_ins = 0xC0, DX_ins = 0x00, DY_ins = 0x40,
-  };
-
-
-typedef struct state {
-  int x, y, tx, ty;
-  unsigned int colour, data, tool;
-} state;
-
-typedef struct image {
-  unsigned long size; // size of the byte sequence
-  unsigned char *bytes; // dem bytes
-} image;
-
-typedef unsigned char byte;
-
-
-// I/O functions
-void writeFile(image *thisImage, char *filename, int filetype);
-unsigned char *readFile(FILE *fp, unsigned long *length);
-
-// main functions
-void solve(char *filename);
-void convert2sk(FILE *fp, char *filename);
-void convert2pgm(FILE *fp, char *filename);
-void freeEverything(unsigned char *input, image *thisImage);
-
-// pgm -> sk functions
-bool verifyPGM(unsigned char *input, unsigned long length);
-image *newSKImage();
-void processPGM(image *thisImage, unsigned char *input);
-void execute(image *thisImage, state *curr_state, bool xVSy);
-void detectColours(unsigned char *input, bool colours[65536]);
-void setColour(image *thisImage, unsigned int rgba);
-unsigned int gray2rgba(unsigned int gray);
-bool absOrRel(int curr, int prev);
-void relativeJump(image *thisImage, state *curr_state, bool xVSy);
-void absoluteJump(image *thisImage, state *curr_state, bool xVSy);
-int maxGray(unsigned char *input, unsigned long length);
-unsigned long startGray(unsigned char *input, unsigned long length);
-void turnToolOff(image *thisImage);
-void turnToolOn(image *thisImage);
-bool inColumn(int column, int gray, unsigned char *input);
-
-// sk -> pgm functions
-bool verifySK(unsigned char *input, unsigned long length);
-image *newPGMImage();
-void processSK(image *thisImage, unsigned char *input, unsigned long length);
-void obeyTOOL(unsigned char map[200][200], state *s, byte op);
-void obeyDX(unsigned char map[200][200], state *s, byte op);
-void obeyDY(unsigned char map[200][200], state *s, byte op);
-void obeyDATA(unsigned char map[200][200], state *s, byte op);
-void obeyDraw(unsigned char map[200][200], state *s);
-void lineFun(unsigned char map[200][200], state *s);
-void diagonalLine(unsigned char map[200][200], state *s);
-void blockFun(unsigned char map[200][200], state *s);
-int getOpcode(byte b);
-int getOperand(byte b);
-int rgba2gray(unsigned int data);
-void pasteBytes(image *thisImage, unsigned char map[200][200]);
+#define _POSIX_C_SOURCE 200809L // mmap, fileno
+#include "converter.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // test functions
 void assert(int line, bool b);
@@ -84,42 +9,121 @@ void test();
 
 void testSetColour();
 void testGray2Rgba();
-void testAbsOrRel();
-void testObeyData();
+void testMoves();
+unsigned int decodedData(unsigned char *bytes, int n);
+void testDecodeData();
+void testDecodeSketch();
 void testGetOpcode();
 void testGetOperand();
 void testRgba2Gray();
-
-
-
+unsigned char *testFile(char *filename, unsigned long *length);
+void checkEncoder(int line, image *sk, image *grays, void encode(image *thisImage, unsigned char *input));
+void testRoundTrip();
+void testCostModel();
+void testPutByte();
+void testStream();
+void testMapPGM();
+void testOutputName();
+void testBatch();
+void testBands();
+void testFrames();
+void testExport();
+void testSeekFrame();
+void testAnimate();
+void testStats();
+void testBlocks();
+void encodeProgressive(image *thisImage, unsigned char *input);
+void testProgressive();
+void testQuantize();
+void encodeOptimized(image *thisImage, unsigned char *input);
+void encodePainter(image *thisImage, unsigned char *input);
+void testOptimize();
+void testFindRuns();
+void testVerifyPGM();
+void testCanvas();
+void keepFirstFrame(display *d, void *data);
+void testReplayConsistency();
+void checkRaster(int line, image *sk, int lit[][2], int n);
+void testRasterPixels();
+
+
+
+// the benchmarks of bench.c have a main function of their own
+#ifndef BENCH
 int main(int argc, char **argv) {
+  options opts = {false, false, false, false, 1, false, false, false, 0, 0, false};
+  unsigned long sizes[2];
+  bool batchMode = false, framesMode = false, exportMode = false, animateMode = false;
+  int i = 1, fps = 10;
+
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (strcmp(argv[i], "--optimize") == 0) opts.optimize = true;
+    else if (strcmp(argv[i], "--painter") == 0) opts.optimize = opts.painter = true;
+    else if (strcmp(argv[i], "--stdout") == 0) opts.toStdout = true;
+    else if (strcmp(argv[i], "--stats") == 0) opts.stats = true;
+    else if (strcmp(argv[i], "--palette") == 0) opts.palette = true;
+    else if (strcmp(argv[i], "--blocks") == 0) opts.blocks = true;
+    else if (strcmp(argv[i], "--progressive") == 0) opts.progressive = true;
+    else if (strcmp(argv[i], "--batch") == 0) batchMode = true;
+    else if (strcmp(argv[i], "--frames") == 0) framesMode = true;
+    else if (strcmp(argv[i], "--export") == 0) exportMode = true;
+    else if (strcmp(argv[i], "--animate") == 0) animateMode = true;
+    else if (strcmp(argv[i], "--fps") == 0 && i + 2 < argc) fps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--colours") == 0 && i + 2 < argc) opts.colours = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--tolerance") == 0 && i + 2 < argc) opts.tolerance = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--bands") == 0 && i + 2 < argc) {
+      opts.bands = atoi(argv[++i]);
+      if (opts.bands == 0) opts.bands = cores();
+    }
+    else break;
+  }
+  // the frame rate may also follow the frames
+  if (animateMode && argc - i > 2 && strcmp(argv[argc - 2], "--fps") == 0) fps = atoi(argv[argc - 1]), argc -= 2;
+  // --progressive and --bands are encoders of their own, they do not combine
+  bool clash = (opts.progressive || opts.bands != 1) && (opts.optimize || opts.blocks || (opts.progressive && opts.bands != 1));
   if (argc == 1) test();
-  else if (argc == 2) solve(argv[1]);
+  else if (i < argc && animateMode) return animate(argv + i, argc - i, fps, &opts) ? 0 : 1;
+  else if (i == argc - 1 && batchMode && !opts.toStdout && !clash) return batch(argv[i], &opts) ? 0 : 1;
+  else if (i == argc - 1 && framesMode) return renderFrames(argv[i], &opts) ? 0 : 1;
+  else if (i == argc - 1 && exportMode) return exportAnimation(argv[i], &opts) ? 0 : 1;
+  else if (i == argc - 1 && !batchMode && !clash) return solve(argv[i], &opts, sizes) ? 0 : 1;
   else {
-    fprintf(stderr, "Use \'./converter file\' for converting.\nUse \'./converter\' for testing.\n");
+    if (clash) fprintf(stderr, "Error: --progressive and --bands combine with neither each other nor --optimize, --painter or --blocks.\n");
+    fprintf(stderr, "Use \'./converter [--optimize] [--painter] [--blocks] [--progressive] [--palette] [--colours n] [--tolerance t]\n"
+      "  [--bands n] [--stdout] [--stats] file\' for converting,\n"
+      "where --blocks covers every gray with rectangles,\n"
+      "--progressive draws coarse tiles first, then the exact pixels,\n"
+      "--colours and --tolerance reduce the image to n grays, or move no pixel by more than t,\n"
+      "--palette draws each gray in its cheapest colour of that gray,\n"
+      "--bands encodes n bands of columns in parallel, one per core for 0,\n"
+      "--progressive and --bands each go alone, without any other encoder,\n"
+      "and --stats prints where the bytes of the sk file go.\n"
+      "Use \'./converter --batch [--optimize] [--painter] dir\' for converting every file of dir,\n"
+      "or \'--batch -\' for the files listed on stdin.\n"
+      "Use \'./converter --frames file.sk\' for writing every frame to file-nnnn.pgm,\n"
+      "or \'--export file.sk\' for writing the animation to file.ppm.\n"
+      "Use \'./converter --animate frame*.pgm --fps n\' for writing the frames as one animated frame.sk.\n"
+      "Use \'./converter\' for testing.\n");
     exit(1);
   }
 
   return 0;
 }
+#endif
 
 // ---------------------------------------------------------
 // write the bytes into a new file
 // if we transfer it into a pgm file we also include the header
-void writeFile(image *thisImage, char *filename, int filetype) {
+bool writeFile(image *thisImage, char *filename, int filetype) {
   FILE *ofp;
-  char *new_filename;
 
-  if (filetype == PGM) new_filename = strcat(filename, ".pgm"); 
-  else new_filename = strcat(filename, ".sk"); 
-  ofp = fopen(new_filename, "wb");
+  ofp = fopen(filename, "wb");
 
-  if (ofp == NULL) { fprintf(stderr, "Error: Cannot write image.\n"); exit(1); }
-  if (filetype == PGM) fprintf(ofp,"P5 200 200 255\n"); //Write header
+  if (ofp == NULL) { fprintf(stderr, "Error: Cannot write image %s.\n", filename); return false; }
+  if (filetype == PGM) fprintf(ofp,"P5 %d %d 255\n", thisImage->width, thisImage->height); //Write header
   fwrite(thisImage->bytes, 1, thisImage->size, ofp); 
   fclose(ofp);
-
-  printf("File %s has been written.\n", new_filename);
+  return true;
 }
 
 // transfer the file into an array and return it
@@ -140,47 +144,173 @@ unsigned char *readFile(FILE *fp, unsigned long *length) {
 
 // detect whether it's a pgm -> sk or sk -> pgm
 // and make the appropriate function call
-void solve(char *filename) {
+// the new file goes next to the old one, filename itself is left alone
+// sizes receives the bytes read and written; returns false on errors
+bool solve(char *filename, options *opts, unsigned long sizes[2]) {
   FILE *fp;
+  char *output;
+  bool done;
 
   fp = fopen(filename, "rb");
-  if (fp == NULL) { fprintf(stderr, "Error: Cannot read image.\n"); exit(1); }
+  if (fp == NULL) { fprintf(stderr, "Error: Cannot read image %s.\n", filename); return false; }
+
+  if ((output = outputName(filename, ".sk", ".pgm")) != NULL)
+    done = convert2pgm(fp, output, opts, sizes);
+  else if ((output = outputName(filename, ".pgm", ".sk")) != NULL)
+    done = convert2sk(fp, output, opts, sizes);
+  else { fprintf(stderr, "Error: incorrect filetype %s.\n", filename); fclose(fp); return false; }
+  free(output);
+  return done;
+}
 
-  if (!(strcmp(filename + (strlen(filename) - 3), ".sk"))) {
-    filename[strcspn(filename, ".")] = '\0';
-    convert2pgm(fp, filename);
-  }
-  else if (!(strcmp(filename + (strlen(filename) - 4), ".pgm"))) {
-    filename[strcspn(filename, ".")] = '\0';
-    convert2sk(fp, filename);
-  }
-  else { fprintf(stderr, "Error: incorrect filetype.\n"); exit(1); }
+// the name of the new file: filename with extension replaced by replacement,
+// or NULL if filename does not end with extension
+char *outputName(char *filename, char *extension, char *replacement) {
+  size_t length = strlen(filename), n = strlen(extension);
+  char *output;
+
+  if (length <= n || strcmp(filename + length - n, extension) != 0) return NULL;
+  output = malloc(length - n + strlen(replacement) + 1);
+  memcpy(output, filename, length - n);
+  strcpy(output + length - n, replacement);
+  return output;
 }
 
 // verify the PGM file
-// convert it to an sk file and write it into a new file
-void convert2sk(FILE *fp, char *filename) {
+// convert it to an sk file, streaming it into the new file or to stdout
+// --optimize picks the cost-model encoder of optimize.c
+// and reports its savings against the plain encoder
+bool convert2sk(FILE *fp, char *filename, options *opts, unsigned long sizes[2]) {
   unsigned long length;
   unsigned char *input = readFile(fp, &length);
+  FILE *ofp, *log = opts->toStdout ? stderr : stdout;
+  image pgm;
+
+  if (!(verifyPGM(input, length, &pgm))) {
+    fprintf(stderr, "Error: Corrupted PGM file.\n");
+    free(input);
+    return false;
+  }
+  ofp = opts->toStdout ? stdout : fopen(filename, "wb");
+  if (ofp == NULL) {
+    fprintf(stderr, "Error: Cannot write image %s.\n", filename);
+    free(input);
+    return false;
+  }
 
-  if (!(verifyPGM(input, length))) { fprintf(stderr, "Error: Corrupted PGM file.\n"); exit(1); } 
-  image *thisImage = newSKImage();
-  processPGM(thisImage, input + startGray(input, length));
-  writeFile(thisImage, filename, SK);
+  if (opts->colours > 0 || opts->tolerance > 0) {
+    int worst = quantize(pgm.bytes, (unsigned long) pgm.width * pgm.height, opts->colours, opts->tolerance);
+    if (!opts->quiet) fprintf(log, "Grays quantised, no pixel moved by more than %d.\n", worst);
+  }
+  image *thisImage = newSKStream(pgm.width, pgm.height, ofp);
+  if (opts->stats) thisImage->stats = newStats();
+  thisImage->palette = opts->palette;
+  if (opts->optimize || opts->blocks) {
+    // both encodings are kept in memory, and only the smaller goes out
+    image *plain = newSKImage(pgm.width, pgm.height), *trial = newSKImage(pgm.width, pgm.height), *kept;
+    plain->palette = trial->palette = opts->palette;
+    processPGM(plain, pgm.bytes);
+    if (opts->blocks) blockPGM(trial, pgm.bytes);
+    else optimizePGM(trial, pgm.bytes, opts);
+    kept = trial->size < plain->size ? trial : plain;
+    for (unsigned long i = 0; i < kept->size; i++) putByte(thisImage, kept->bytes[i]);
+    flushSK(thisImage);
+    if (!opts->quiet && kept == trial) fprintf(log, "Optimised to %lu bytes, %lu bytes (%.1f%%) smaller than the plain encoder.\n",
+      trial->size, plain->size - trial->size, 100.0 * (plain->size - trial->size) / plain->size);
+    else if (!opts->quiet) fprintf(log, "Kept the plain encoder's %lu bytes, %s needs %lu bytes (%.1f%%) more.\n",
+      plain->size, opts->blocks ? "--blocks" : "--optimize", trial->size - plain->size, 100.0 * (trial->size - plain->size) / plain->size);
+    freeEverything(NULL, plain);
+    freeEverything(NULL, trial);
+  }
+  else if (opts->progressive) {
+    unsigned long coarse = progressivePGM(thisImage, pgm.bytes);
+    flushSK(thisImage);
+    if (!opts->quiet) fprintf(log, "The first %lu bytes (%.1f%%) draw the tiles, the rest the exact pixels.\n", coarse,
+      100.0 * coarse / thisImage->written);
+  }
+  else {
+    if (opts->bands > 1) processBands(thisImage, pgm.bytes, opts->bands);
+    else processPGM(thisImage, pgm.bytes);
+    flushSK(thisImage);
+  }
+  if (ofp != stdout) {
+    fclose(ofp);
+    if (!opts->quiet) fprintf(log, "File %s has been written.\n", filename);
+  }
+  if (opts->stats) {
+    printStats(thisImage->stats, log, length, pgm.width, pgm.height);
+    freeStats(thisImage->stats);
+  }
+  sizes[0] = length;
+  sizes[1] = thisImage->written;
   freeEverything(input, thisImage);
+  return true;
 }
 
 // verify the sk file
-// convert it to a pgm file and write it into a new file
-void convert2pgm(FILE *fp, char *filename) {
+// convert it to a pgm file, rendering straight into the mapped new file
+// and falling back to writing it in one go if it cannot be mapped
+bool convert2pgm(FILE *fp, char *filename, options *opts, unsigned long sizes[2]) {
   unsigned long length;
   unsigned char *input = readFile(fp, &length);
+  bool written = true;
 
-  if (!(verifySK(input, length))) { fprintf(stderr, "Error: Corrupted SK file.\n"); exit(1); } 
-  image *thisImage = newPGMImage();
-  processSK(thisImage, input, length);
-  writeFile(thisImage, filename, PGM);
-  freeEverything(input, thisImage);
+  int width, height;
+
+  if (!(verifySK(input, length))) {
+    fprintf(stderr, "Error: Corrupted SK file.\n");
+    free(input);
+    return false;
+  }
+  sketchCanvas(input, length, &width, &height);
+  image *thisImage = mapPGM(filename, width, height);
+  if (thisImage != NULL) {
+    processSK(thisImage, input, length);
+    unmapPGM(thisImage);
+  }
+  else {
+    thisImage = newPGMImage(width, height);
+    processSK(thisImage, input, length);
+    written = writeFile(thisImage, filename, PGM);
+    free(thisImage->bytes);
+    free(thisImage);
+  }
+  if (written && !opts->quiet) printf("File %s has been written.\n", filename);
+  sizes[0] = length;
+  sizes[1] = (unsigned long) width * height;
+  free(input);
+  return written;
+}
+
+// create the pgm file at its full size and map it into memory, so that the
+// grays are written straight into the file behind its header
+// returns NULL if the file cannot be mapped
+image *mapPGM(char *filename, int width, int height) {
+  char header[32];
+  int headerLength = sprintf(header, "P5 %d %d 255\n", width, height);
+  unsigned long size = (unsigned long) width * height;
+  unsigned char *map = MAP_FAILED;
+  FILE *fp;
+
+  fp = fopen(filename, "wb+");
+  if (fp != NULL && fseek(fp, headerLength + size - 1, SEEK_SET) == 0 && fputc(0, fp) == 0 && fflush(fp) == 0)
+    map = mmap(NULL, headerLength + size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+  if (fp != NULL) fclose(fp);
+  if (map == MAP_FAILED) return NULL;
+
+  memcpy(map, header, headerLength);
+  image *thisImage = (image *)malloc(sizeof(struct image));
+  *thisImage = (image) {0, map + headerLength, width, height, size, false, NULL, 0};
+  return thisImage;
+}
+
+// write a mapped pgm file back and release it
+void unmapPGM(image *thisImage) {
+  int headerLength = snprintf(NULL, 0, "P5 %d %d 255\n", thisImage->width, thisImage->height);
+  unsigned char *map = thisImage->bytes - headerLength;
+
+  munmap(map, headerLength + (unsigned long) thisImage->width * thisImage->height);
+  free(thisImage);
 }
 
 void freeEverything(unsigned char *input, image *thisImage) {
@@ -192,268 +322,299 @@ void freeEverything(unsigned char *input, image *thisImage) {
 // ---------------------------------------------------------
 
 // verify that this is a valid PGM file
-bool verifyPGM(unsigned char *input, unsigned long length) {
-  unsigned long i;
-  int maxVal = 0, valSize, val;
+// and point pgm at its width x height gray values
+bool verifyPGM(unsigned char *input, unsigned long length, image *pgm) {
+  unsigned long i = 2;
+  int maxVal;
 
-  // check that file is large enough
-  if (length == 4015) return false;
   // check that magic number is P5
-  if (input[0] != 'P' || input[1] != '5') return false;
-  // check that width and height are both 200
-  if (input[3] != '2' || input[4] != '0' || input[5] != '0' || \
-    input[7] != '2' || input[8] != '0' || input[9] != '0') return false;
-
-  maxVal = maxGray(input, length);
-  i = startGray(input, length) - 1;
+  if (length < 2 || input[0] != 'P' || input[1] != '5') return false;
+  // read width, height and maximum gray value
+  if (!(headerNumber(input, length, &i, &pgm->width) && headerNumber(input, length, &i, &pgm->height) && \
+    headerNumber(input, length, &i, &maxVal))) return false;
   // check maximum gray value
   if (!(0 < maxVal && maxVal < 256)) return false;
-  valSize = 1;
-  // check for correct whitespace in the "header"
-  if (!(isspace(input[2]) && isspace(input[6]) && isspace(input[10]) && isspace(input[i++]))) return false;
+  // a single whitespace separates the header from the gray values
+  if (!(i < length && isspace(input[i++]))) return false;
+  // check that file is large enough
+  pgm->size = (unsigned long) pgm->width * pgm->height;
+  if (length - i < pgm->size) return false;
+  pgm->bytes = input + i;
   // check grayscale values are <= maxVal
-  for (; i < length; i += valSize) {
-    val = 0;
-    for (int j = 0; j < valSize; j++) val = val * 10 + (input[i + j] - '0');
-    if (val > maxVal) return false;
-  }
+  for (unsigned long j = 0; j < pgm->size; j++)
+    if (pgm->bytes[j] > maxVal) return false;
   return true;
 }
 
+// read the next number of the pgm header into value
+// it must follow whitespace, comments from # to the end of the line are skipped
+bool headerNumber(unsigned char *input, unsigned long length, unsigned long *i, int *value) {
+  bool separated = false;
+
+  while (*i < length && (isspace(input[*i]) || input[*i] == '#')) {
+    if (input[*i] == '#')
+      while (*i < length && input[*i] != '\n') (*i)++;
+    else (*i)++;
+    separated = true;
+  }
+  if (!separated || *i >= length || !isdigit(input[*i])) return false;
+
+  *value = 0;
+  for (; *i < length && isdigit(input[*i]); (*i)++) {
+    if (*value > 65535) return false;
+    *value = *value * 10 + (input[*i] - '0');
+  }
+  return 0 < *value && *value <= 65535;
+}
+
 // initialise a new sk image struct
-image *newSKImage() {
+image *newSKImage(int width, int height) {
   image *thisImage;
 
   thisImage = (image *)malloc(sizeof(struct image));
   thisImage->size = 0;
-  thisImage->bytes = (unsigned char *)malloc(1000000 * sizeof(unsigned char));
+  thisImage->bytes = NULL;
+  thisImage->width = width;
+  thisImage->height = height;
+  thisImage->capacity = 0;
+  thisImage->stream = false;
+  thisImage->sink = NULL;
+  thisImage->written = 0;
+  thisImage->stats = NULL;
+  thisImage->palette = false;
 
   return thisImage;
 }
 
-// the actual pgm -> sk conversion
-void processPGM(image *thisImage, unsigned char *input) {
-  bool colours[65536], found_sequence;
-  state *s = (state *)malloc(sizeof(state));
-  *s = (state) {0, 0, 0, 0, 0, 0, LINE};
-
-  // detect all the colours in the image
-  memset(colours, 0, 65536 * sizeof(bool));
-  detectColours(input, colours);
-
-  turnToolOff(thisImage);
-  for (unsigned int gray = 0; gray < 65536; gray++) {
-    if (colours[gray]) {
-
-      // for all the colours, change to it just once
-      s->colour = gray;
-      setColour(thisImage, gray2rgba(gray));
-
-      for (int columns = 0; columns < 200;  columns++) {
-        
-        // starting from the 0th column, detect which columns have pixels in that colour
-        if (inColumn(columns, gray, input)) {
-          s->tx = columns;
-          execute(thisImage, s, 1);
-          s->x = columns;
-
-          // move along the column, jumping over the pixels not in that colour
-          found_sequence = false;
-          for (int rows = 0; rows < 200; rows++) {
-            if(input[rows * 200 + columns] == s->colour && found_sequence == false) {
-              s->ty = rows;
-              execute(thisImage, s, 0);
-              s->y = rows;
-              found_sequence = true;
-            }
-
-            // move and draw at the same time, taking full advantage of DY's RLE mechanism
-            else if (input[rows * 200 + columns] != s->colour && found_sequence == true) {
-              s->ty = rows;
-              turnToolOn(thisImage);
-              execute(thisImage, s, 0);
-              turnToolOff(thisImage);
-              s->y = rows;
-              found_sequence = false;
-            }
-          }
-
-          // check whether there's a valid sequence at the end of the column
-          if (found_sequence) {
-            s->ty = 200;
-            turnToolOn(thisImage);
-            execute(thisImage, s, 0);
-            s->y = 200;
-            turnToolOff(thisImage);
-          }
-        } 
-      }
-    colours[gray] = false;
-    }
-  }
-  free(s);
-}
+// initialise an sk image that streams its bytes to sink through a buffer
+// of STREAM_BUFFER bytes, so memory does not grow with the output
+image *newSKStream(int width, int height, FILE *sink) {
+  image *thisImage = newSKImage(width, height);
 
-// make a jump (DX, DY, TARGETX or TARGETY)
-// choose the one with least bytes used
-// if s->tool = LINE, also draw
-void execute(image *thisImage, state *curr_state, bool xVSy) {
-  unsigned int target, current;
+  thisImage->bytes = (unsigned char *)malloc(STREAM_BUFFER);
+  thisImage->capacity = STREAM_BUFFER;
+  thisImage->stream = true;
+  thisImage->sink = sink;
+  return thisImage;
+}
 
-  if (xVSy) {
-    target = curr_state->tx;
-    current = curr_state->x;
-  }
-  else {
-    target = curr_state->ty;
-    current = curr_state->y;
+// write the buffered bytes of a streamed sk image to its sink
+void flushSK(image *thisImage) {
+  if (thisImage->sink != NULL && fwrite(thisImage->bytes, 1, thisImage->size, thisImage->sink) != thisImage->size) {
+    fprintf(stderr, "Error: Cannot write image.\n");
+    exit(1);
   }
-  
-  if (absOrRel(target, current))
-    relativeJump(thisImage, curr_state, xVSy);
-  else
-    absoluteJump(thisImage, curr_state, xVSy);
+  thisImage->written += thisImage->size;
+  thisImage->size = 0;
 }
 
-// Detects all the gray shades used in the image
-void detectColours(unsigned char *input, bool colours[65536]) {
-  for (int i = 0; i < 200; i++)
-    for (int j = 0; j < 200; j++)
-      colours[input[i * 200 + j]] = true;
+// append a byte to an sk image
+// a full buffer is flushed when streaming, otherwise it doubles
+void putByte(image *thisImage, unsigned char b) {
+  if (thisImage->size == thisImage->capacity && thisImage->stream) flushSK(thisImage);
+  else if (thisImage->size == thisImage->capacity) {
+    thisImage->capacity = thisImage->capacity == 0 ? 4096 : 2 * thisImage->capacity;
+    thisImage->bytes = realloc(thisImage->bytes, thisImage->capacity);
+    if (thisImage->bytes == NULL) { fprintf(stderr, "Error: Out of memory.\n"); exit(1); }
+  }
+  thisImage->bytes[thisImage->size++] = b;
+  if (thisImage->stats != NULL) countByte(thisImage->stats, b);
 }
 
-// 6 DATA instructions to set the correct rgba value
-// 1 COLOUR instruction
-void setColour(image *thisImage, unsigned int rgba) {
-  thisImage->bytes[thisImage->size++] = DATA_ins | ((rgba >> 30) & 0x3F);
-  thisImage->bytes[thisImage->size++] = DATA_ins | ((rgba >> 24) & 0x3F);
-  thisImage->bytes[thisImage->size++] = DATA_ins | ((rgba >> 18) & 0x3F);
-  thisImage->bytes[thisImage->size++] = DATA_ins | ((rgba >> 12) & 0x3F);
-  thisImage->bytes[thisImage->size++] = DATA_ins | ((rgba >> 6) & 0x3F);
-  thisImage->bytes[thisImage->size++] = DATA_ins | (rgba & 0x3F);
+// the actual pgm -> sk conversion
+// the input holds width x height grays, row by row
+void processPGM(image *thisImage, unsigned char *input) {
+  if (thisImage->width != DEFAULT_WIDTH || thisImage->height != DEFAULT_HEIGHT) setCanvas(thisImage);
+  processBand(thisImage, input, 0, thisImage->width);
+}
 
-  thisImage->bytes[thisImage->size++] = COLOUR_ins;
+// encode the band of columns x0 <= x < x1 on its own
+// a band after the first cannot know where the previous one left the pen,
+// so it starts with an absolute move to the top of its first column
+void processBand(image *thisImage, unsigned char *input, int x0, int x1) {
+  spans *r = findRuns(input, thisImage->width, thisImage->height, x0, x1);
+  state s = {x0, 0, x0, 0, 0, 0, LINE};
+
+  // a band after the first cannot know where the band before it ended
+  if (x0 > 0) {
+    putByte(thisImage, NONE_ins);
+    setData(thisImage, x0);
+    putByte(thisImage, TARGETX_ins);
+    putByte(thisImage, TARGETY_ins);
+    putByte(thisImage, DY_ins);
+    s.tool = NONE;
+  }
+  drawRuns(thisImage, r, &s);
+  freeRuns(r);
 }
 
-// convert a gray value into an rgba value
-unsigned int gray2rgba(unsigned int gray) {
-    return 255 + ((gray << 8) & (255 << 8)) +((gray << 16) & (255 << 16)) +((gray << 24) & (UINT32_C(255) << 24));
-}  
+// draw every run from the drawing state s, a gray at a time in ascending order
+void drawRuns(image *thisImage, spans *r, state *s) {
+  bool *upwards = runDirections(r, *s);
 
-// calculate which type of jump is least costly
-// returns false for absolute jump
-// returns true for relative jump
-bool absOrRel(int curr, int prev) {
-  int nr_commands_absolute = 0, nr_commands_relative;
+  for (int gray = 0; gray < 256; gray++) {
+    if (r->start[gray] == r->start[gray + 1]) continue;
 
-  if (curr < 64) // bytes for DATA
-    nr_commands_absolute += 1; 
-  else
-    nr_commands_absolute += 2;
-  
-  nr_commands_absolute += 2; // bytes for TARGETY and DY
-  nr_commands_relative = ceil((curr - prev) / 31.0);
+    // for all the colours, change to it just once
+    s->colour = gray;
+    setColour(thisImage, gray2rgba(gray));
 
-  return (nr_commands_relative <= nr_commands_absolute);
+    // move to every run, then draw it with DY, which moves and draws at once
+    for (unsigned long i = r->start[gray]; i < r->start[gray + 1]; i++) {
+      span *thisRun = &r->runs[i];
+      moveTo(thisImage, s, thisRun->x, upwards[i] ? thisRun->last : thisRun->y);
+      lineTo(thisImage, s, thisRun->x, upwards[i] ? thisRun->y : thisRun->last);
+    }
+  }
+  free(upwards);
 }
 
-// determine if we're going forward (positive) or backwards (negative)
-// make the jump with the necessary amount of DX or DY commands
-void relativeJump(image *thisImage, state *curr_state, bool xVSy) {
-  int substractor, val, distance, opcode;
-  bool loop = true;
-
-  if (xVSy) {
-    distance = curr_state->tx - curr_state->x;
-    opcode = DX_ins;
+// choose for every run whether it is drawn top down or bottom up, so that the
+// moves to the runs and the runs themselves take the fewest bytes overall
+// bytes[d] is the cost of the runs so far with the last one drawn in direction d,
+// from[i][d] the direction of run i - 1 on the cheapest way to run i drawn in d
+bool *runDirections(spans *r, state start) {
+  unsigned long n = r->start[256];
+  bool *upwards = malloc(n + 1);
+  unsigned char (*from)[2] = malloc((n + 1) * sizeof(*from));
+  long bytes[2] = {0, 0};
+
+  for (unsigned long i = 0; i < n; i++) {
+    span *run = &r->runs[i];
+    long next[2];
+
+    for (int d = 0; d < 2; d++) {
+      int entry = d ? run->last : run->y, exit = d ? run->y : run->last;
+      state drawn = {run->x, entry, run->x, entry, 0, 0, NONE};
+      int draw = lineTo(NULL, &drawn, run->x, exit);
+
+      next[d] = -1;
+      for (int p = 0; p < (i == 0 ? 1 : 2); p++) {
+        state s = start;
+        if (i > 0) {
+          int y = p ? run[-1].y : run[-1].last;
+          s = (state) {run[-1].x, y, run[-1].x, y, 0, 0, LINE};
+        }
+        long cost = bytes[p] + moveTo(NULL, &s, run->x, entry) + draw;
+        if (next[d] < 0 || cost < next[d]) { next[d] = cost; from[i][d] = p; }
+      }
+    }
+    bytes[0] = next[0];
+    bytes[1] = next[1];
   }
-  else {
-    distance = curr_state->ty - curr_state->y;
-    opcode = DY_ins;
+  if (n > 0) {
+    int d = bytes[1] < bytes[0];
+    for (unsigned long i = n; i-- > 0; ) {
+      upwards[i] = d;
+      d = from[i][d];
+    }
   }
+  free(from);
+  return upwards;
+}
 
-  if (distance == 0) return;
-  if (distance < 0) substractor = 32; // negative
-  else substractor = 31; // positive
-
-  while (loop) {
-    if ((substractor == 31 && distance >= 31) || (substractor == 32 && distance <= -32)) {
-      val = substractor == 31? 31 : -32;
-
-      thisImage->bytes[thisImage->size++] = opcode | (val & 0x3F);
-      distance -= val;
-    } 
-    else {
-      if (distance != 0) { // make sure that we don't add a byte for nothing
-        thisImage->bytes[thisImage->size++] = opcode | (distance & 0x3F);    
+// split the columns x0 <= x < x1 into runs of one gray in a single pass,
+// then bucket the runs by gray, keeping them in column and row order
+spans *findRuns(unsigned char *input, int width, int height, int x0, int x1) {
+  spans *r = (spans *)malloc(sizeof(spans));
+  unsigned long n = 0, capacity = 1024, count[256];
+  span *all = (span *)malloc(capacity * sizeof(span));
+
+  memset(count, 0, sizeof(count));
+  for (int x = x0; x < x1; x++) {
+    unsigned char *column = input + x;
+    int y = 0;
+
+    for (int row = 1; row <= height; row++) {
+      if (row < height && column[(unsigned long) row * width] == column[(unsigned long) y * width]) continue;
+      if (n == capacity) {
+        capacity *= 2;
+        all = (span *)realloc(all, capacity * sizeof(span));
       }
-      loop = false;
-    } 
+      all[n++] = (span) {x, y, row - 1};
+      count[column[(unsigned long) y * width]]++;
+      y = row;
+    }
   }
-  if (xVSy) thisImage->bytes[thisImage->size++] = DY_ins ; // Execute 
-}
 
-// set DATA to either TX or TY
-// calls TARGETX/TARGETY
-void absoluteJump(image *thisImage, state *curr_state, bool xVSy) {
-  unsigned int target, opcode;
-
-  if (xVSy) {
-    target = curr_state->tx;
-    opcode = TARGETX_ins;
+  r->start[0] = 0;
+  for (int gray = 0; gray < 256; gray++) r->start[gray + 1] = r->start[gray] + count[gray];
+  r->runs = (span *)malloc((n > 0 ? n : 1) * sizeof(span));
+  memcpy(count, r->start, sizeof(count));
+  for (unsigned long i = 0; i < n; i++) {
+    unsigned char gray = input[(unsigned long) all[i].y * width + all[i].x];
+    r->runs[count[gray]++] = all[i];
   }
-  else {
-    target = curr_state->ty;
-    opcode = TARGETY_ins;
-  }
-
-  if (target >= 64)
-    thisImage->bytes[thisImage->size++] = DATA_ins | ((target >> 6) & 0x3F);
+  free(all);
+  return r;
+}
 
-  thisImage->bytes[thisImage->size++] = DATA_ins | (target & 0x3F);
-  thisImage->bytes[thisImage->size++] = opcode;
-  thisImage->bytes[thisImage->size++] = DY_ins; // execute
+void freeRuns(spans *r) {
+  free(r->runs);
+  free(r);
 }
 
-// determinate the max gray value as specified in the pgm header
-int maxGray(unsigned char *input, unsigned long length) {
-  unsigned long i;
-  int maxVal = 0;
+// declare a canvas size other than 200x200 at the start of the file:
+// DATA(width) TARGETX DATA(height) TARGETY, then clear both targets again
+void setCanvas(image *thisImage) {
+  setData(thisImage, thisImage->width);
+  putByte(thisImage, TARGETX_ins);
+  setData(thisImage, thisImage->height);
+  putByte(thisImage, TARGETY_ins);
+  putByte(thisImage, TARGETX_ins);
+  putByte(thisImage, TARGETY_ins);
+}
 
-  i = 11;
-  for (; isspace(input[i]) == 0 && i < length; i++)
-    maxVal = maxVal * 10 + (input[i] - '0');
-  return maxVal;
+// the fewest DATA instructions that load value, 6 bits each
+void setData(image *thisImage, unsigned int value) {
+  for (int shift = 6 * (dataBytes(value) - 1); shift >= 0; shift -= 6)
+    putByte(thisImage, DATA_ins | ((value >> shift) & 0x3F));
 }
 
-// determine the index where the gray bytes start to appear
-unsigned long startGray(unsigned char *input, unsigned long length) {
-  unsigned long i;
-  for (i = 11; i < length && isspace(input[i]) == 0; i++)
-    ;
+// number of DATA instructions needed to load value into the DATA register,
+// which every TOOL leaves empty, so 0 needs none
+int dataBytes(unsigned int value) {
+  int n = value > 0;
 
-  if (i != length) return (i + 1);
-  else { fprintf(stderr, "Error: Can't find the gray values"); exit(1); }
-  return -1;
+  while (value >= 64 && n < 6) {
+    value >>= 6;
+    n++;
+  }
+  return n;
 }
 
-// TOOL = NONE
-void turnToolOff(image *thisImage) {
-  thisImage->bytes[thisImage->size++] = NONE_ins;
+// up to 6 DATA instructions to set the correct rgba value, leading zero
+// groups are left out as every TOOL leaves the DATA register empty
+// 1 COLOUR instruction
+// a palette image uses the cheapest rgba value of the same gray instead
+void setColour(image *thisImage, unsigned int rgba) {
+  if (thisImage->palette) rgba = cheapColour(rgba2gray(rgba));
+  setData(thisImage, rgba);
+  putByte(thisImage, COLOUR_ins);
 }
 
-// TOOL = LINE
-void turnToolOn(image *thisImage) {
-  thisImage->bytes[thisImage->size++] = LINE_ins;
+// the rgba value with the fewest DATA instructions that converts back to gray,
+// the gray itself if nothing is cheaper
+// the smallest such value has the least red, then green, then blue
+unsigned int cheapColour(int gray) {
+  for (unsigned int r = 0; r < 256; r++) {
+    if (rgba2gray(r << 24 | 0xFFFFFF) < gray) continue;
+    for (unsigned int g = 0; g < 256; g++) {
+      if (rgba2gray(r << 24 | g << 16 | 0xFFFF) < gray) continue;
+      for (unsigned int b = 0; b < 256; b++) {
+        unsigned int rgba = r << 24 | g << 16 | b << 8 | 0xFF;
+        if (rgba2gray(rgba) != gray) continue;
+        return dataBytes(rgba) < dataBytes(gray2rgba(gray)) ? rgba : gray2rgba(gray);
+      }
+    }
+  }
+  return gray2rgba(gray);
 }
 
-// check if the gray value is present in the column
-bool inColumn(int column, int gray, unsigned char *input) {
-  for (int row = 0; row < 200; row++)
-    if (input[row * 200 + column] == gray)
-      return true;
-  return false;
-}
+// convert a gray value into an rgba value
+unsigned int gray2rgba(unsigned int gray) {
+    return 255 + ((gray << 8) & (255 << 8)) +((gray << 16) & (255 << 16)) +((gray << 24) & (UINT32_C(255) << 24));
+}  
 
 // ---------------------------------------------------------
 
@@ -471,163 +632,55 @@ bool verifySK(unsigned char *input, unsigned long length) {
 }
 
 // initialise a new pgm image struct
-image *newPGMImage() {
+image *newPGMImage(int width, int height) {
   image *thisImage;
 
   thisImage = (image *)malloc(sizeof(struct image));
   thisImage->size = 0;
-  thisImage->bytes = (unsigned char *)malloc(40015 * sizeof(unsigned char));
+  thisImage->bytes = (unsigned char *)malloc((unsigned long) width * height * sizeof(unsigned char));
+  thisImage->width = width;
+  thisImage->height = height;
+  thisImage->capacity = (unsigned long) width * height;
+  thisImage->stream = false;
+  thisImage->sink = NULL;
+  thisImage->written = 0;
+  thisImage->stats = NULL;
+  thisImage->palette = false;
 
   return thisImage;
 }
 
 // the actual sk -> pgm conversion
-// fill a 2d array that's 200x200 with gray values
+// decode the sk instructions and draw them with the same rasteriser the viewer uses
+// the still image is the first frame the viewer shows, so stop at SHOW or NEXTFRAME
 void processSK(image *thisImage, unsigned char *input, unsigned long length) {
-  int op, opcode;
-  unsigned char map[200][200];
-  state *s = (state *)malloc(sizeof(state));
-  *s = (state) {0, 0, 0, 0, 0xFF, 0, LINE};
-  memset(map, 0, 200 * 200 * sizeof(unsigned char));
-  
-  // take each sk instruction and call the appropriate function
-  for (int i = 0; i < length; i++) {
-    op = input[i];
-    opcode = getOpcode(op);
-
-    switch (opcode) {
-      case TOOL:
-        obeyTOOL(map, s, op);
+  display *d = newDisplay("sk", thisImage->width, thisImage->height);
+  program *p = decodeSketch(input, length);
+  bool shown = false;
+
+  for (int i = 0; i < p->size && !shown; i++) {
+    command *c = &p->commands[i];
+
+    switch (c->op) {
+      case COLOUR_cmd:
+        colour(d, c->data);
         break;
-      case DX:
-        obeyDX(map, s, op);
+      case LINE_cmd:
+        line(d, c->x, c->y, c->tx, c->ty);
         break;
-      case DY:
-        obeyDY(map, s, op);
+      case BLOCK_cmd:
+        block(d, c->x, c->y, c->tx - c->x, c->ty - c->y);
         break;
-      case DATA:
-        obeyDATA(map, s, op);
+      case SHOW_cmd:
+      case FRAME_cmd:
+        shown = true;
         break;
     }
   }
 
-  pasteBytes(thisImage, map);
-  free(s);
-}
-
-
-/* from now on it's what you'd expect to also see in sketch.c */
-
-
-void obeyTOOL(unsigned char map[200][200], state *s, byte op) {
-  int operand = getOperand(op);
-
-  switch(operand) {
-    case NONE:
-    case LINE:
-    case BLOCK:
-      s->tool = operand;
-      break;
-    case COLOUR:
-      s->colour = rgba2gray(s->data);
-      break;
-    case TARGETX:
-      s->tx = s->data;
-      break;
-    case TARGETY:
-      s->ty = s->data;
-      break;
-  }
-  s->data = 0;
-}
-
-void obeyDX(unsigned char map[200][200], state *s, byte op) {
-  int operand = getOperand(op);
-  
-  s->tx += operand;
-}
-
-void obeyDY(unsigned char map[200][200], state *s, byte op) {
-  int operand = getOperand(op);
-  
-  s->ty += operand;
-  if (s->tool == LINE || s->tool == BLOCK) obeyDraw(map, s);
-  s->x = s->tx;
-  s->y = s->ty;
-}
-
-void obeyDATA(unsigned char map[200][200], state *s, byte op) {
-  int operand = getOperand(op);
-  
-  s->data = (s->data << 6) | (operand & 0x3F);
-}
-
-void obeyDraw(unsigned char map[200][200], state *s) {
-  switch(s->tool) {
-    case LINE:
-      lineFun(map, s); 
-      break;
-    case BLOCK:
-      blockFun(map, s);
-      break;
-  }
-}
-
-void lineFun(unsigned char map[200][200], state *s) {
-  if (s->x == s->tx && s->y != s->ty) { // vertical line
-    int y = s->y < s->ty ? s->y : s->ty;
-    int ty = s->y > s->ty? s->y : s->ty;
-
-    for (int i = y; i < ty; i++)
-      map[i][s->x] = s->colour;
-  }
-  else if (s->y == s->ty && s->x != s->tx) { // horizontal line
-    int x = s->x < s->tx ? s->x : s->tx;
-    int tx = s->x > s->tx? s->x : s->tx;
-
-    for (int i = x; i < tx; i++)
-      map[s->y][i] = s->colour;
-  }
-  else diagonalLine(map, s);
-}
-
-// draw diagonal lines
-// we first find the length of the line using the Pythagorean theorem
-// then we calculate the incrementors that we're going to use
-void diagonalLine(unsigned char map[200][200], state *s) {
-  double x, y, addx, addy;
-  double length;
-
-  length = sqrt((s->tx - s->x)*(s->tx - s->x) + (s->ty - s->y)*(s->ty - s->y));
-  addx = (s->tx - s->x) / length;
-  addy = (s->ty - s->y) / length;
-  x = s->x;
-  y = s->y;
-
-  for(double i = 0; i < length; i++) {
-      map[(int)y][(int)x] = s->colour;
-      x += addx;
-      y += addy;
-  }
-}
-
-void blockFun(unsigned char map[200][200], state *s) {
-  for (int rows = s->y; rows < s->ty; rows++)
-    for (int columns = s->x; columns < s->tx; columns++)
-      map[rows][columns] = s->colour;
-}
- 
-// Extract an opcode from a byte (two most significant bits).
-int getOpcode(byte b) {
-  return b >> 6;
-}
-
-// Extract an operand (-32..31) from the rightmost 6 bits of a byte.
-int getOperand(byte b) {
-  int val = b & 0x3F;
-
-  if (val >> 5) val = val | 0xFFFFFFC0; // extend sign
-  return val;
+  pasteBytes(thisImage, getCanvas(d));
+  freeProgram(p);
+  freeDisplay(d);
 }
 
 // convert a rgba value into a gray value
@@ -640,10 +693,19 @@ int rgba2gray(unsigned int data) {
   return round(0.299 * R +  0.587 * G + 0.114 * B);
 }
 
-void pasteBytes(image *thisImage, unsigned char map[200][200]) {
-  for (int rows = 0; rows < 200; rows++)
-    for (int columns = 0; columns < 200; columns++)
-      thisImage->bytes[thisImage->size++] = map[rows][columns];
+// convert the rgba pixels into gray bytes, runs of one colour are converted once
+void pasteBytes(image *thisImage, unsigned int *pixels) {
+  unsigned long n = (unsigned long) thisImage->width * thisImage->height;
+  unsigned int last = pixels[0];
+  unsigned char gray = rgba2gray(last);
+
+  for (unsigned long i = 0; i < n; i++) {
+    if (pixels[i] != last) {
+      last = pixels[i];
+      gray = rgba2gray(last);
+    }
+    thisImage->bytes[thisImage->size++] = gray;
+  }
 }
 
 // ---------------------------------------------------------
@@ -657,24 +719,47 @@ void assert(int line, bool b) {
 void test() {
   testSetColour();
   testGray2Rgba();
-  testAbsOrRel();
-  testObeyData();
+  testMoves();
+  testDecodeData();
+  testDecodeSketch();
   testGetOpcode();
   testGetOperand();
   testRgba2Gray();
+  testRoundTrip();
+  testCostModel();
+  testPutByte();
+  testStream();
+  testMapPGM();
+  testOutputName();
+  testBatch();
+  testBands();
+  testFrames();
+  testExport();
+  testSeekFrame();
+  testAnimate();
+  testStats();
+  testBlocks();
+  testProgressive();
+  testQuantize();
+  testOptimize();
+  testFindRuns();
+  testVerifyPGM();
+  testCanvas();
+  testReplayConsistency();
+  testRasterPixels();
 
   printf("All tests passed\n");
 }
 
 
 void testSetColour() {
-  image *thisImage = newSKImage();
+  image *thisImage = newSKImage(200, 200);
 
   setColour(thisImage, 0x121212FF);
-  assert(__LINE__, strncmp((const char *)thisImage->bytes, "\xC0\xD2\xC4\xE1\xCB\xFF\x83", 7) == 0);
+  assert(__LINE__, thisImage->size == 6 && strncmp((const char *)thisImage->bytes, "\xD2\xC4\xE1\xCB\xFF\x83", 6) == 0);
   thisImage->size = 0;
   setColour(thisImage, 0x272727FF);
-  assert(__LINE__, strncmp((const char *)thisImage->bytes, "\xC0\xE7\xC9\xF2\xDF\xFF\x83", 7) == 0);
+  assert(__LINE__, thisImage->size == 6 && strncmp((const char *)thisImage->bytes, "\xE7\xC9\xF2\xDF\xFF\x83", 6) == 0);
   thisImage->size = 0;
   setColour(thisImage, 0xAAAAAAFF);
   assert(__LINE__, strncmp((const char *)thisImage->bytes, "\xC2\xEA\xEA\xEA\xEB\xFF\x83", 7) == 0);
@@ -683,7 +768,22 @@ void testSetColour() {
   assert(__LINE__, strncmp((const char *)thisImage->bytes, "\xC3\xFF\xFF\xFF\xFF\xFF\x83", 7) == 0);
   thisImage->size = 0;
   setColour(thisImage, 0x0D0D0DFF);
-  assert(__LINE__, strncmp((const char *)thisImage->bytes, "\xC0\xCD\xC3\xD0\xF7\xFF\x83", 7) == 0);
+  assert(__LINE__, thisImage->size == 6 && strncmp((const char *)thisImage->bytes, "\xCD\xC3\xD0\xF7\xFF\x83", 6) == 0);
+  thisImage->size = 0;
+  setColour(thisImage, 0x000000FF);
+  assert(__LINE__, thisImage->size == 3 && strncmp((const char *)thisImage->bytes, "\xC3\xFF\x83", 3) == 0);
+
+  // a palette image picks the cheapest colour of the same gray
+  thisImage->palette = true;
+  for (int gray = 0; gray < 256; gray++) {
+    unsigned int rgba = cheapColour(gray);
+    assert(__LINE__, rgba2gray(rgba) == gray && dataBytes(rgba) <= dataBytes(gray2rgba(gray)));
+    if (gray > 198) assert(__LINE__, rgba == gray2rgba(gray));
+  }
+  assert(__LINE__, dataBytes(cheapColour(30)) == 3 && dataBytes(cheapColour(178)) == 4);
+  thisImage->size = 0;
+  setColour(thisImage, 0x969696FF);
+  assert(__LINE__, thisImage->size == 5 && rgba2gray(cheapColour(0x96)) == 0x96);
 
   free(thisImage->bytes);
   free(thisImage);
@@ -711,55 +811,79 @@ void testGray2Rgba() {
   assert(__LINE__, gray2rgba(0x07) == 0x070707FF);
 }
 
-void testAbsOrRel() {
-  assert(__LINE__, absOrRel(27, 20) == true);
-  assert(__LINE__, absOrRel(37, 20) == true);
-  assert(__LINE__, absOrRel(47, 20) == true);
-  assert(__LINE__, absOrRel(57, 20) == true);
-  assert(__LINE__, absOrRel(67, 20) == true);
-  assert(__LINE__, absOrRel(77, 20) == true);
-  assert(__LINE__, absOrRel(87, 20) == true);
-  assert(__LINE__, absOrRel(97, 20) == true);
-  assert(__LINE__, absOrRel(107, 20) == true);
-  assert(__LINE__, absOrRel(117, 20) == true);
-  assert(__LINE__, absOrRel(127, 20) == true);
-  assert(__LINE__, absOrRel(137, 20) == true);
-  assert(__LINE__, absOrRel(147, 20) == false);
-  assert(__LINE__, absOrRel(157, 20) == false);
-  assert(__LINE__, absOrRel(167, 20) == false);
-  assert(__LINE__, absOrRel(177, 20) == false);
-  assert(__LINE__, absOrRel(187, 20) == false);
-  assert(__LINE__, absOrRel(197, 20) == false);
-  assert(__LINE__, absOrRel(199, 20) == false);
-}
-
-void testObeyData() {
-  unsigned char map[200][200];
-  state *s = (state *)malloc(sizeof(state));
-  *s = (state) {0, 0, 0, 0, 0, 0, LINE};
-
-  obeyDATA(map, s, 0x32);
-  assert(__LINE__, s->data == 0x00000032);
-  obeyDATA(map, s, 0x64);
-  assert(__LINE__, s->data == 0xCA4);
-  obeyDATA(map, s, 0xFF);
-  assert(__LINE__, s->data == 0x3293F);
-  obeyDATA(map, s, 0x00);
-  assert(__LINE__, s->data == 0xCA4FC0);
-  obeyDATA(map, s, 0x77);
-  assert(__LINE__, s->data == 0x3293F037);
-  obeyDATA(map, s, 0xAA);
-  assert(__LINE__, s->data == 0xA4FC0DEA);
-  obeyDATA(map, s, 0xBB);
-  assert(__LINE__, s->data == 0x3F037ABB);
-  obeyDATA(map, s, 0xCC);
-  assert(__LINE__, s->data == 0xC0DEAECC);
-  obeyDATA(map, s, 0xDD);
-  assert(__LINE__, s->data == 0x37ABB31D);
-  obeyDATA(map, s, 0x01);
-  assert(__LINE__, s->data == 0xEAECC741);
-
-  free(s);
+// moves take the fewest bytes of chains and absolute targets, which count as
+// many bytes as they write and end where they should
+void testMoves() {
+  image *sk = newSKImage(200, 200);
+  state s = {0, 180, 0, 180, 0, 0, NONE};
+
+  // TARGETY with the register empty, then DY 20
+  assert(__LINE__, moveTo(NULL, &s, 0, 20) == 2);
+  s = (state) {0, 0, 0, 0, 0, 0, NONE};
+  // DATA 39, TARGETY, then DY 31 instead of DATA DATA TARGETY DY
+  assert(__LINE__, moveTo(NULL, &s, 0, 150) == 4 && moveTo(NULL, &s, 0, 118) == 1);
+  sk->stats = newStats();
+  for (int from = 0; from < 700; from += 23)
+    for (int to = 0; to < 700; to += 17) {
+      state a = {from, from, from, from, 0, 0, NONE}, b = a;
+      sk->size = 0;
+      *sk->stats = (stats) {{0}, 0, 0, 0, NULL, false, {0}, 0, from, from, from, from, NONE};
+      int n = moveTo(NULL, &a, to, 699 - to);
+      assert(__LINE__, moveTo(sk, &b, to, 699 - to) == n && sk->size == n);
+      assert(__LINE__, sk->stats->x == to && sk->stats->y == 699 - to);
+      int relative = chainBytes(699 - to - from) > 0 ? chainBytes(699 - to - from) : 1;
+      assert(__LINE__, n <= chainBytes(to - from) + (dataBytes(699 - to) + 2 < relative ? dataBytes(699 - to) + 2 : relative));
+    }
+  freeStats(sk->stats);
+  free(sk->bytes);
+  free(sk);
+}
+
+// decode the first n DATA bytes followed by COLOUR and return the register
+unsigned int decodedData(unsigned char *bytes, int n) {
+  unsigned char input[16];
+  unsigned int data;
+
+  for (int i = 0; i < n; i++) input[i] = DATA_ins | (bytes[i] & 0x3F);
+  input[n] = COLOUR_ins;
+  program *p = decodeSketch(input, n + 1);
+  data = p->commands[0].data;
+  freeProgram(p);
+  return data;
+}
+
+void testDecodeData() {
+  unsigned char bytes[] = {0x32, 0x64, 0xFF, 0x00, 0x77, 0xAA, 0xBB, 0xCC, 0xDD, 0x01};
+
+  assert(__LINE__, decodedData(bytes, 1) == 0x00000032);
+  assert(__LINE__, decodedData(bytes, 2) == 0xCA4);
+  assert(__LINE__, decodedData(bytes, 3) == 0x3293F);
+  assert(__LINE__, decodedData(bytes, 4) == 0xCA4FC0);
+  assert(__LINE__, decodedData(bytes, 5) == 0x3293F037);
+  assert(__LINE__, decodedData(bytes, 6) == 0xA4FC0DEA);
+  assert(__LINE__, decodedData(bytes, 7) == 0x3F037ABB);
+  assert(__LINE__, decodedData(bytes, 8) == 0xC0DEAECC);
+  assert(__LINE__, decodedData(bytes, 9) == 0x37ABB31D);
+  assert(__LINE__, decodedData(bytes, 10) == 0xEAECC741);
+}
+
+// DX/DY, TARGETX/Y and TOOL switches fold into resolved commands,
+// and the state is reset after every NEXTFRAME
+void testDecodeSketch() {
+  unsigned char input[] = {0x1e, 0x5e, NONE_ins, 0x1e, 0x7F, LINE_ins, 0x5e,
+    0xC3, 0xC7, TARGETX_ins, BLOCK_ins, 0x45, 0x88, 0x42, 0xC5, 0x87, 0x86};
+  program *p = decodeSketch(input, sizeof(input));
+  command *c = p->commands;
+
+  assert(__LINE__, p->size == 7 && p->nframes == 2);
+  assert(__LINE__, c[0].op == LINE_cmd && c[0].x == 0 && c[0].y == 0 && c[0].tx == 30 && c[0].ty == 30);
+  assert(__LINE__, c[1].op == LINE_cmd && c[1].x == 60 && c[1].y == 29 && c[1].tx == 60 && c[1].ty == 59);
+  assert(__LINE__, c[2].op == BLOCK_cmd && c[2].x == 60 && c[2].y == 59 && c[2].tx == 199 && c[2].ty == 64);
+  assert(__LINE__, c[3].op == FRAME_cmd && p->frames[1] == 4);
+  assert(__LINE__, c[4].op == LINE_cmd && c[4].x == 0 && c[4].y == 0 && c[4].tx == 0 && c[4].ty == 2);
+  assert(__LINE__, c[5].op == PAUSE_cmd && c[5].data == 5);
+  assert(__LINE__, c[6].op == SHOW_cmd && p->frames[2] == 7);
+  freeProgram(p);
 }
 
 void testGetOpcode() {
@@ -827,3 +951,729 @@ void testRgba2Gray() {
   assert(__LINE__, rgba2gray(0x777777FF) == 0x77);
   assert(__LINE__, rgba2gray(0x070707FF) == 0x07);
 }
+
+// read a whole file from the working directory
+unsigned char *testFile(char *filename, unsigned long *length) {
+  FILE *fp = fopen(filename, "rb");
+
+  assert(__LINE__, fp != NULL);
+  return readFile(fp, length);
+}
+
+// encode the grays into sk, convert them back, and check they come out the same
+void checkEncoder(int line, image *sk, image *grays, void encode(image *thisImage, unsigned char *input)) {
+  image *pgm = newPGMImage(grays->width, grays->height);
+
+  encode(sk, grays->bytes);
+  processSK(pgm, sk->bytes, sk->size);
+  assert(line, pgm->size == grays->size && memcmp(pgm->bytes, grays->bytes, pgm->size) == 0);
+  freeEverything(NULL, pgm);
+}
+
+// pgm -> sk -> pgm gives back the original grays
+void testRoundTrip() {
+  char *files[] = {"fractal.pgm", "bands.pgm"};
+
+  for (int f = 0; f < 2; f++) {
+    unsigned long length;
+    unsigned char *input = testFile(files[f], &length);
+    image grays;
+    assert(__LINE__, verifyPGM(input, length, &grays));
+    image *sk = newSKImage(grays.width, grays.height);
+
+    checkEncoder(__LINE__, sk, &grays, processPGM);
+    assert(__LINE__, grays.size == 200 * 200);
+
+    // and with the palette of cheapest colours
+    unsigned long plain = sk->size;
+    sk->size = 0;
+    sk->palette = true;
+    checkEncoder(__LINE__, sk, &grays, processPGM);
+    assert(__LINE__, sk->size < plain);
+    freeEverything(input, sk);
+  }
+}
+
+// the byte counts of the optimising encoder are the bytes it writes
+void testCostModel() {
+  image *sk = newSKImage(200, 200);
+  state s = {0, 0, 0, 0, 0, 0, LINE}, copy;
+  int moves[][2] = {{0, 5}, {40, 5}, {1000, 2}, {999, 300}, {10, 301}, {10, 10}};
+
+  assert(__LINE__, chainBytes(0) == 0 && chainBytes(31) == 1 && chainBytes(32) == 2);
+  assert(__LINE__, chainBytes(-32) == 1 && chainBytes(-33) == 2);
+  for (int i = 0; i < 6; i++) {
+    unsigned long before = sk->size;
+    copy = s;
+    int n = moveTo(NULL, &copy, moves[i][0], moves[i][1]);
+    assert(__LINE__, moveTo(sk, &s, moves[i][0], moves[i][1]) == n && sk->size - before == n);
+    assert(__LINE__, memcmp(&copy, &s, sizeof(state)) == 0);
+    before = sk->size;
+    assert(__LINE__, lineTo(sk, &s, s.x + 40, s.y + 40) == sk->size - before);
+    before = sk->size;
+    assert(__LINE__, blockTo(sk, &s, s.x + 70, s.y + 3) == sk->size - before);
+  }
+  free(sk->bytes);
+  free(sk);
+}
+
+// sk images grow as needed, also past the old fixed buffer of 1000000 bytes
+void testPutByte() {
+  int width = 1000, height = 700;
+  unsigned char *grays = malloc(width * height);
+  image *sk = newSKImage(width, height), *pgm = newPGMImage(width, height);
+
+  for (int i = 0; i < 10000; i++) putByte(sk, i % 64);
+  assert(__LINE__, sk->size == 10000 && sk->capacity >= 10000 && sk->bytes[9999] == 9999 % 64);
+  sk->size = 0;
+  for (int i = 0; i < width * height; i++) grays[i] = (i * 7919u + i / width) % 4 * 60;
+  processPGM(sk, grays);
+  assert(__LINE__, sk->size > 1000000 && sk->size <= sk->capacity);
+  processSK(pgm, sk->bytes, sk->size);
+  assert(__LINE__, memcmp(pgm->bytes, grays, pgm->size) == 0);
+  free(grays);
+  free(sk->bytes);
+  free(sk);
+  free(pgm->bytes);
+  free(pgm);
+}
+
+// a streamed sk file has the bytes of one built in memory, in a bounded buffer
+void testStream() {
+  unsigned long length;
+  unsigned char *input = testFile("fractal.pgm", &length), *streamed;
+  image grays;
+  assert(__LINE__, verifyPGM(input, length, &grays));
+  image *sk = newSKImage(grays.width, grays.height), *counted = newSKStream(grays.width, grays.height, NULL);
+  FILE *fp = tmpfile();
+  image *stream = newSKStream(grays.width, grays.height, fp);
+
+  processPGM(sk, grays.bytes);
+  processPGM(stream, grays.bytes);
+  processPGM(counted, grays.bytes);
+  assert(__LINE__, stream->capacity == STREAM_BUFFER && stream->written > 0);
+  flushSK(stream);
+  flushSK(counted);
+  assert(__LINE__, stream->written == sk->size && counted->written == sk->size);
+  streamed = readFile(fp, &length);
+  assert(__LINE__, length == sk->size && memcmp(streamed, sk->bytes, length) == 0);
+  free(streamed);
+  freeEverything(input, sk);
+  free(stream->bytes);
+  free(stream);
+  free(counted->bytes);
+  free(counted);
+}
+
+// rendering into a mapped pgm file gives the file writeFile would write
+void testMapPGM() {
+  unsigned long length, written;
+  unsigned char *input = testFile("bands.sk", &length), *file;
+  char *filename = "testMapPGM.pgm";
+  image *pgm = newPGMImage(200, 200), *mapped = mapPGM(filename, 200, 200);
+
+  assert(__LINE__, mapped != NULL);
+  processSK(pgm, input, length);
+  processSK(mapped, input, length);
+  unmapPGM(mapped);
+  file = readFile(fopen(filename, "rb"), &written);
+  assert(__LINE__, written == 15 + 200 * 200 && memcmp(file, "P5 200 200 255\n", 15) == 0);
+  assert(__LINE__, memcmp(file + 15, pgm->bytes, 200 * 200) == 0);
+  remove(filename);
+  free(file);
+  freeEverything(input, pgm);
+}
+
+void testOutputName() {
+  char *names[] = {"fractal.pgm", "./dir.v2/fractal.sk", "fractal.txt", ".sk"};
+  char *expected[] = {"fractal.sk", "./dir.v2/fractal.pgm", NULL, NULL};
+
+  for (int i = 0; i < 4; i++) {
+    char *output = outputName(names[i], ".pgm", ".sk");
+    if (output == NULL) output = outputName(names[i], ".sk", ".pgm");
+    assert(__LINE__, (output == NULL) == (expected[i] == NULL));
+    if (output != NULL) assert(__LINE__, strcmp(output, expected[i]) == 0);
+    free(output);
+  }
+}
+
+// a batch converts every pgm file of a directory to the sk file of the plain encoder
+void testBatch() {
+  char *files[] = {"fractal", "bands"}, path[64];
+  options opts = {false, false, false, true};
+
+  mkdir("testBatch", 0755);
+  for (int f = 0; f < 2; f++) {
+    unsigned long length;
+    sprintf(path, "%s.pgm", files[f]);
+    unsigned char *input = testFile(path, &length);
+    sprintf(path, "testBatch/%s.pgm", files[f]);
+    FILE *fp = fopen(path, "wb");
+    fwrite(input, 1, length, fp);
+    fclose(fp);
+    free(input);
+  }
+  assert(__LINE__, batch("testBatch", &opts));
+
+  for (int f = 0; f < 2; f++) {
+    unsigned long length, written;
+    sprintf(path, "testBatch/%s.pgm", files[f]);
+    unsigned char *input = testFile(path, &length), *output;
+    image grays;
+    assert(__LINE__, verifyPGM(input, length, &grays));
+    image *sk = newSKImage(grays.width, grays.height);
+    processPGM(sk, grays.bytes);
+    remove(path);
+    sprintf(path, "testBatch/%s.sk", files[f]);
+    output = testFile(path, &written);
+    assert(__LINE__, written == sk->size && memcmp(output, sk->bytes, written) == 0);
+    remove(path);
+    free(output);
+    freeEverything(input, sk);
+  }
+  assert(__LINE__, remove("testBatch") == 0);
+}
+
+// any number of bands decodes to the same image, one band is the plain encoding
+void testBands() {
+  int width = 700, height = 300;
+  unsigned char *grays = malloc(width * height);
+
+  for (int i = 0; i < width * height; i++) grays[i] = ((i % width) / 90 * 40 + (i / width) / 50 * 7 + (i * 7919u) % 3) % 256;
+  for (int bands = 1; bands <= 8; bands++) {
+    image *plain = newSKImage(width, height), *sk = newSKImage(width, height), *pgm = newPGMImage(width, height);
+    processPGM(plain, grays);
+    processBands(sk, grays, bands);
+    if (bands == 1) assert(__LINE__, sk->size == plain->size && memcmp(sk->bytes, plain->bytes, sk->size) == 0);
+    processSK(pgm, sk->bytes, sk->size);
+    assert(__LINE__, memcmp(pgm->bytes, grays, pgm->size) == 0);
+    free(plain->bytes);
+    free(plain);
+    free(sk->bytes);
+    free(sk);
+    free(pgm->bytes);
+    free(pgm);
+  }
+  free(grays);
+}
+
+// keep every frame shown, one after the other, as gray bytes
+void keepFrames(display *d, void *data) {
+  image *frames = data;
+
+  if (frames->size + (unsigned long) frames->width * frames->height <= frames->capacity) pasteBytes(frames, getCanvas(d));
+}
+
+// frames rendered on their own show the same as the viewer playing them in order,
+// also when a frame takes its colour over from the frame before
+void testFrames() {
+  char *files[] = {"sketch09.sk", "testFrames.sk"};
+  image *sk = newSKImage(200, 200);
+  FILE *fp = fopen(files[1], "wb");
+
+  // a red block, then a frame that draws a line without choosing a colour
+  setColour(sk, 0xFF0000FF);
+  putByte(sk, BLOCK_ins);
+  putByte(sk, DX_ins | 20);
+  putByte(sk, DY_ins | 20);
+  putByte(sk, NEXTFRAME_ins);
+  putByte(sk, DX_ins | 30);
+  putByte(sk, DY_ins | 10);
+  fwrite(sk->bytes, 1, sk->size, fp);
+  fclose(fp);
+
+  for (int f = 0; f < 2; f++) {
+    unsigned long length;
+    unsigned char *input = testFile(files[f], &length);
+    program *p = decodeSketch(input, length);
+    unsigned int colours[p->nframes];
+    display *d = newDisplay(files[f], p->width, p->height), *own = newDisplay(files[f], p->width, p->height);
+    image *viewed = newPGMImage(p->width, p->height), *rendered = newPGMImage(p->width, p->height);
+
+    viewed->size = rendered->size = 0;
+    viewed->capacity = rendered->capacity = 8UL * p->width * p->height;
+    viewed->bytes = realloc(viewed->bytes, viewed->capacity);
+    rendered->bytes = realloc(rendered->bytes, rendered->capacity);
+    startColours(p, colours);
+    assert(__LINE__, p->nframes == (f == 0 ? 3 : 2));
+    if (f == 1) assert(__LINE__, colours[0] == 0xFFFFFFFF && colours[1] == 0xFF0000FF);
+
+    onShow(d, keepFrames, viewed);
+    playFrames(d, files[f], p->nframes);
+    onShow(own, keepFrames, rendered);
+    for (int k = p->nframes - 1; k >= 0; k--) renderFrame(own, p, k, colours[k]), show(own);
+    // frames were rendered last first, so compare them in reverse
+    unsigned long n = (unsigned long) p->width * p->height;
+    assert(__LINE__, viewed->size == rendered->size && viewed->size == p->nframes * n);
+    for (int k = 0; k < p->nframes; k++)
+      assert(__LINE__, memcmp(viewed->bytes + k * n, rendered->bytes + (p->nframes - 1 - k) * n, n) == 0);
+    freeDisplay(d);
+    freeDisplay(own);
+    freeProgram(p);
+    freeEverything(input, viewed);
+    free(rendered->bytes);
+    free(rendered);
+  }
+  remove(files[1]);
+  free(sk->bytes);
+  free(sk);
+}
+
+// seeking to a frame and drawing it alone shows the same as playing every
+// frame up to it, once it starts in the colour the frames before leave, and
+// a frame that is not there is reported, drawing nothing
+void testSeekFrame() {
+  unsigned long length, n;
+  unsigned char *input = testFile("sketch09.sk", &length);
+  program *p = decodeSketch(input, length);
+  unsigned int colours[p->nframes];
+  display *d = newDisplay("sketch09.sk", p->width, p->height);
+  image *viewed = newPGMImage(p->width, p->height), *seeked = newPGMImage(p->width, p->height);
+
+  n = (unsigned long) p->width * p->height;
+  viewed->size = seeked->size = 0;
+  viewed->capacity = seeked->capacity = p->nframes * n;
+  viewed->bytes = realloc(viewed->bytes, viewed->capacity);
+  seeked->bytes = realloc(seeked->bytes, seeked->capacity);
+  startColours(p, colours);
+  onShow(d, keepFrames, viewed);
+  playFrames(d, "sketch09.sk", p->nframes);
+  assert(__LINE__, p->nframes > 1 && viewed->size == p->nframes * n);
+  for (int k = 0; k < p->nframes; k++) {
+    display *own = newDisplay("sketch09.sk", p->width, p->height);
+    colour(own, colours[k]);
+    onShow(own, keepFrames, seeked);
+    assert(__LINE__, playFrame(own, "sketch09.sk", k));
+    assert(__LINE__, memcmp(seeked->bytes + k * n, viewed->bytes + k * n, n) == 0);
+    freeDisplay(own);
+  }
+  // there is no frame past the last, nor before the first: nothing is shown
+  assert(__LINE__, !playFrame(d, "sketch09.sk", p->nframes) && !playFrame(d, "sketch09.sk", -1));
+  assert(__LINE__, viewed->size == p->nframes * n);
+  freeDisplay(d);
+  freeProgram(p);
+  freeEverything(input, viewed);
+  free(seeked->bytes);
+  free(seeked);
+}
+
+// the exported stream has an image for every show, lasting as long as the
+// viewer would pause, and ends with the last frame the viewer shows
+void testExport() {
+  options quiet = {false, false, false, true, 1};
+  unsigned long length, size, delays = 0, pauses = 0, offset = 0, delay;
+  unsigned char *input = testFile("sketch09.sk", &length), *ppm;
+  program *p = decodeSketch(input, length);
+  display *d = newDisplay("sketch09.sk", p->width, p->height);
+  int images = 0, shows = p->nframes, width, height, header;
+
+  for (int i = 0; i < p->size; i++) {
+    if (p->commands[i].op == SHOW_cmd) shows++;
+    if (p->commands[i].op == PAUSE_cmd) pauses += p->commands[i].data;
+  }
+  assert(__LINE__, exportAnimation("sketch09.sk", &quiet));
+  ppm = testFile("sketch09.ppm", &size);
+  while (offset < size) {
+    char text[64] = "";
+    memcpy(text, ppm + offset, size - offset < 63 ? size - offset : 63);
+    assert(__LINE__, sscanf(text, "P6\n# delay %lu ms\n%d %d\n255%n", &delay, &width, &height, &header) == 3);
+    assert(__LINE__, width == p->width && height == p->height);
+    delays += delay;
+    images++;
+    offset += header + 1 + 3UL * width * height;
+  }
+  assert(__LINE__, offset == size && images == shows && delays == pauses + shows * SHOW_DELAY);
+
+  playFrames(d, "sketch09.sk", p->nframes);
+  unsigned char *last = ppm + size - 3UL * width * height;
+  for (int i = 0; i < width * height; i++)
+    assert(__LINE__, last[3 * i] == getFrame(d)[i] >> 24 && last[3 * i + 2] == ((getFrame(d)[i] >> 8) & 0xFF));
+  remove("sketch09.ppm");
+  freeDisplay(d);
+  freeProgram(p);
+  free(input);
+  free(ppm);
+}
+
+// the viewer shows every animated frame that differs from the one before,
+// for as long as the frame rate asks, and a repeated frame costs no bytes
+void testAnimate() {
+  unsigned char grays[4][60 * 40], *frames[4] = {grays[0], grays[1], grays[2], grays[3]};
+  unsigned long n = 60 * 40, length;
+
+  // a square moving over bands, held for a frame, then a frame of its own
+  for (int k = 0; k < 4; k++)
+    for (unsigned long i = 0; i < n; i++) {
+      int x = i % 60, y = i / 60, left = k == 2 ? 10 : 10 * k;
+      grays[k][i] = k == 3 ? (x * y) % 7 * 30 : (x >= left && x < left + 15 && y >= 10 && y < 25 ? 250 : y / 10 * 40);
+    }
+  image *sk = newSKImage(60, 40), *viewed = newPGMImage(60, 40);
+  assert(__LINE__, animatePGM(sk, frames, 4, 20) == 3);
+  FILE *fp = fopen("testAnimate.sk", "wb");
+  fwrite(sk->bytes, 1, sk->size, fp);
+  fclose(fp);
+
+  unsigned char *input = testFile("testAnimate.sk", &length);
+  program *p = decodeSketch(input, length);
+  display *d = newDisplay("testAnimate.sk", p->width, p->height);
+  assert(__LINE__, p->nframes == 3 && p->width == 60 && p->height == 40);
+  viewed->size = 0;
+  viewed->capacity = 8 * n;
+  viewed->bytes = realloc(viewed->bytes, viewed->capacity);
+  onShow(d, keepFrames, viewed);
+  playFrames(d, "testAnimate.sk", p->nframes);
+  assert(__LINE__, viewed->size == 3 * n && getClock(d) == 200);
+  assert(__LINE__, memcmp(viewed->bytes, grays[0], n) == 0 && memcmp(viewed->bytes + n, grays[1], n) == 0);
+  assert(__LINE__, memcmp(viewed->bytes + 2 * n, grays[3], n) == 0);
+  remove("testAnimate.sk");
+  freeDisplay(d);
+  freeProgram(p);
+  freeEverything(input, viewed);
+  free(sk->bytes);
+  free(sk);
+}
+
+// every byte is counted once, by what it is for
+void testStats() {
+  image *sk = newSKImage(200, 200), pgm;
+  unsigned long length, total = 0;
+  unsigned char *input = testFile("fractal.pgm", &length);
+
+  sk->stats = newStats();
+  setColour(sk, gray2rgba(5));
+  putByte(sk, BLOCK_ins);
+  putByte(sk, DX_ins | 3);
+  putByte(sk, DY_ins | 2);
+  putByte(sk, LINE_ins);
+  putByte(sk, DY_ins | 4);
+  setColour(sk, gray2rgba(5));
+  putByte(sk, NEXTFRAME_ins);
+  assert(__LINE__, sk->stats->bytes[STATS_COLOUR_DATA] == 10 && sk->stats->bytes[STATS_COLOUR] == 2);
+  assert(__LINE__, sk->stats->bytes[STATS_SWITCH] == 2 && sk->stats->bytes[STATS_TOOL] == 1);
+  assert(__LINE__, sk->stats->bytes[STATS_DX] == 1 && sk->stats->bytes[STATS_DY] == 2);
+  assert(__LINE__, sk->stats->changes == 2 && sk->stats->distinct == 1);
+  // a 3x2 block and a line of 5 pixels
+  assert(__LINE__, sk->stats->pixels == 11 && sk->stats->runs[2] == 2);
+  freeStats(sk->stats);
+
+  sk->size = 0;
+  sk->stats = newStats();
+  verifyPGM(input, length, &pgm);
+  processPGM(sk, pgm.bytes);
+  for (int k = 0; k < STATS_KINDS; k++) total += sk->stats->bytes[k];
+  assert(__LINE__, total == sk->size && sk->stats->distinct == sk->stats->changes);
+  freeStats(sk->stats);
+
+  // an animation, with the DATA of its pauses
+  unsigned char *frames[3] = {pgm.bytes, pgm.bytes, input};
+  sk->size = total = 0;
+  sk->stats = newStats();
+  animatePGM(sk, frames, 3, 2);
+  for (int k = 0; k < STATS_KINDS; k++) total += sk->stats->bytes[k];
+  assert(__LINE__, total == sk->size && sk->stats->bytes[STATS_OTHER_DATA] > 0);
+  freeStats(sk->stats);
+  freeEverything(input, sk);
+}
+
+// block encoded files convert back to the same grays, flat regions take a
+// block each, and only BLOCK draws
+void testBlocks() {
+  char *files[] = {"fractal.pgm", "bands.pgm"};
+  unsigned char noise[90 * 50];
+  unsigned int seed = 7;
+
+  for (int i = 0; i < 90 * 50; i++) noise[i] = (seed = seed * 1103515245u + 12345u) >> 29;
+  for (int f = 0; f < 3; f++) {
+    unsigned long length;
+    unsigned char *input = f < 2 ? testFile(files[f], &length) : NULL;
+    image grays = {90 * 50, noise, 90, 50};
+    if (f < 2) assert(__LINE__, verifyPGM(input, length, &grays));
+    image *sk = newSKImage(grays.width, grays.height);
+
+    sk->stats = newStats();
+    checkEncoder(__LINE__, sk, &grays, blockPGM);
+    assert(__LINE__, sk->stats->pixels >= grays.size - 4000 * (f == 1));
+    // the 9 bands other than black are a block each
+    if (f == 1) assert(__LINE__, sk->stats->runs[11] == 9 && sk->size < 150);
+    freeStats(sk->stats);
+    freeEverything(input, sk);
+  }
+}
+
+// the progressive encoder, keeping the bytes of its tiles in tileBytes
+unsigned long tileBytes;
+void encodeProgressive(image *thisImage, unsigned char *input) {
+  tileBytes = progressivePGM(thisImage, input);
+}
+
+// progressive files convert back to the same grays, and the tiles at their
+// start already draw a picture much closer to the image than the black canvas
+void testProgressive() {
+  char *files[] = {"fractal.pgm", "bands.pgm"};
+
+  for (int f = 0; f < 2; f++) {
+    unsigned long length, near = 0, far = 0;
+    unsigned char *input = testFile(files[f], &length);
+    image grays;
+    assert(__LINE__, verifyPGM(input, length, &grays));
+    image *sk = newSKImage(grays.width, grays.height), *tiles = newPGMImage(grays.width, grays.height);
+
+    checkEncoder(__LINE__, sk, &grays, encodeProgressive);
+    assert(__LINE__, tileBytes > 0 && tileBytes < sk->size / 10);
+    processSK(tiles, sk->bytes, tileBytes);
+    for (unsigned long i = 0; i < grays.size; i++) {
+      near += abs(tiles->bytes[i] - grays.bytes[i]);
+      far += grays.bytes[i];
+    }
+    assert(__LINE__, 4 * near < far);
+    freeEverything(input, sk);
+    freeEverything(NULL, tiles);
+  }
+}
+
+// grays are grouped with the least squared error, the tolerance bounds every
+// change, and fewer grays give a smaller sk file
+void testQuantize() {
+  unsigned char grays[] = {0, 0, 10, 10, 200}, merged[] = {0, 3, 6, 9, 12, 100}, counts[256];
+  unsigned long length;
+  unsigned char *input = testFile("fractal.pgm", &length);
+  image pgm;
+
+  assert(__LINE__, quantize(grays, 5, 2, 0) == 5);
+  assert(__LINE__, grays[0] == 5 && grays[3] == 5 && grays[4] == 200);
+  assert(__LINE__, quantize(merged, 6, 0, 5) <= 5);
+  assert(__LINE__, merged[0] == merged[3] && merged[4] != merged[3] && merged[5] == 100);
+  // the tolerance holds with a number of colours too, taking more colours if need be
+  for (int t = 1; t < 8; t++) {
+    unsigned char ramp[256];
+    for (int i = 0; i < 256; i++) ramp[i] = i;
+    assert(__LINE__, quantize(ramp, 256, 8, t) <= t);
+  }
+
+  assert(__LINE__, verifyPGM(input, length, &pgm));
+  image *plain = newSKImage(pgm.width, pgm.height), *sk = newSKImage(pgm.width, pgm.height);
+  checkEncoder(__LINE__, plain, &pgm, processPGM);
+  assert(__LINE__, quantize(pgm.bytes, pgm.size, 0, 2) <= 2);
+  assert(__LINE__, quantize(pgm.bytes, pgm.size, 16, 0) > 0);
+  memset(counts, 0, sizeof(counts));
+  for (unsigned long i = 0; i < pgm.size; i++) counts[pgm.bytes[i]] = 1;
+  int used = 0;
+  for (int gray = 0; gray < 256; gray++) used += counts[gray];
+  assert(__LINE__, used <= 16);
+  checkEncoder(__LINE__, sk, &pgm, processPGM);
+  assert(__LINE__, sk->size < plain->size);
+  freeEverything(input, plain);
+  freeEverything(NULL, sk);
+}
+
+// the optimising encoder, without and with painting over
+void encodeOptimized(image *thisImage, unsigned char *input) {
+  options opts = {true, false};
+  optimizePGM(thisImage, input, &opts);
+}
+
+void encodePainter(image *thisImage, unsigned char *input) {
+  options opts = {true, true};
+  optimizePGM(thisImage, input, &opts);
+}
+
+// optimised sk files convert back to the same pixels and are smaller,
+// and painting over never makes them larger
+void testOptimize() {
+  char *files[] = {"fractal.pgm", "bands.pgm"};
+  unsigned char shapes[70 * 40];
+
+  for (int f = 0; f < 4; f++) {
+    unsigned long length, sizes[2];
+    unsigned char *input = NULL;
+    image grays = {70 * 40, shapes, 70, 40};
+    if (f < 2) {
+      input = testFile(files[f], &length);
+      assert(__LINE__, verifyPGM(input, length, &grays));
+    }
+    // blocks, diagonals, rows and noise of a few grays on a canvas of its own size,
+    // then a white canvas with a gray frame around a black square
+    else for (int i = 0; i < 70 * 40; i++) {
+      int x = i % 70, y = i / 70;
+      if (f == 2) shapes[i] = (x == y || x + y == 60) ? 200 : (x > 40 && y > 10 ? 90 : (y == 5 ? 30 : (i * 7919) % 5 * 10));
+      else shapes[i] = (x >= 20 && x < 50 && y >= 10 && y < 30) ? (x > 22 && x < 47 && y > 12 && y < 27 ? 0 : 128) : 255;
+    }
+    image *plain = newSKImage(grays.width, grays.height);
+    checkEncoder(__LINE__, plain, &grays, processPGM);
+
+    for (int painter = 0; painter < 2; painter++) {
+      image *sk = newSKImage(grays.width, grays.height);
+      checkEncoder(__LINE__, sk, &grays, painter ? encodePainter : encodeOptimized);
+      assert(__LINE__, sk->size < plain->size);
+      sizes[painter] = sk->size;
+      freeEverything(NULL, sk);
+    }
+    assert(__LINE__, sizes[1] <= sizes[0]);
+    if (f == 3) assert(__LINE__, sizes[1] < sizes[0]);
+    freeEverything(input, plain);
+  }
+}
+
+// keep the first frame the viewer shows as gray bytes
+void keepFirstFrame(display *d, void *data) {
+  image *frame = data;
+
+  if (frame->size == 0) pasteBytes(frame, getCanvas(d));
+}
+
+// the converter and the viewer replay agree on every sample sketch; both draw
+// with displaysoft.c, so this checks the replay, and testRasterPixels the pixels
+void testReplayConsistency() {
+  char filename[16];
+
+  for (int i = 0; i <= 10; i++) {
+    unsigned long length;
+    if (i < 10) sprintf(filename, "sketch%02d.sk", i);
+    else strcpy(filename, "bands.sk");
+    unsigned char *input = testFile(filename, &length);
+    image *pgm = newPGMImage(200, 200), *frame = newPGMImage(200, 200);
+    display *d = newDisplay(filename, 200, 200);
+
+    processSK(pgm, input, length);
+    onShow(d, keepFirstFrame, frame);
+    snapshot(d, filename);
+    assert(__LINE__, frame->size == 200 * 200 && memcmp(pgm->bytes, frame->bytes, frame->size) == 0);
+    freeDisplay(d);
+    freeEverything(input, pgm);
+    free(frame->bytes);
+    free(frame);
+  }
+}
+
+// draw the sketch through processSK and through the viewer, and check the top
+// left 16x16 of both against the n pixels lit, given as (x,y) pairs
+void checkRaster(int line, image *sk, int lit[][2], int n) {
+  image *pgm = newPGMImage(200, 200), *frame = newPGMImage(200, 200);
+  display *d = newDisplay("testRaster.sk", 200, 200);
+  FILE *fp = fopen("testRaster.sk", "wb");
+
+  fwrite(sk->bytes, 1, sk->size, fp);
+  fclose(fp);
+  processSK(pgm, sk->bytes, sk->size);
+  onShow(d, keepFirstFrame, frame);
+  snapshot(d, "testRaster.sk");
+  for (int y = 0; y < 16; y++)
+    for (int x = 0; x < 16; x++) {
+      bool on = false;
+      for (int k = 0; k < n; k++) on |= lit[k][0] == x && lit[k][1] == y;
+      assert(line, pgm->bytes[y * 200 + x] == (on ? 255 : 0) && frame->bytes[y * 200 + x] == (on ? 255 : 0));
+    }
+  remove("testRaster.sk");
+  freeDisplay(d);
+  freeEverything(NULL, sk);
+  freeEverything(NULL, pgm);
+  freeEverything(NULL, frame);
+}
+
+// both paths draw the pixels worked out by hand: lines include both end
+// points, blocks are half open, and a line to a far off end point is drawn
+// as far as the canvas goes
+void testRasterPixels() {
+  // 45 degrees (0,0)-(4,4), 2:1 (4,4)-(8,6), vertical (8,6)-(8,9), block (8,9)-(11,10)
+  int lit[][2] = {{0, 0}, {1, 1}, {2, 2}, {3, 3}, {4, 4}, {5, 5}, {6, 5}, {7, 6}, {8, 6},
+                  {8, 7}, {8, 8}, {8, 9}, {9, 9}, {10, 9}};
+  image *sk = newSKImage(200, 200);
+  setColour(sk, gray2rgba(255));
+  putByte(sk, DX_ins | 4);
+  putByte(sk, DY_ins | 4);
+  putByte(sk, DX_ins | 4);
+  putByte(sk, DY_ins | 2);
+  putByte(sk, DY_ins | 3);
+  putByte(sk, BLOCK_ins);
+  putByte(sk, DX_ins | 3);
+  putByte(sk, DY_ins | 1);
+  checkRaster(__LINE__, sk, lit, 14);
+
+  // 1:3 (0,0)-(2,6): row i is column (4i + 6) / 12, then 5:1 up (2,6)-(7,5)
+  int steep[][2] = {{0, 0}, {0, 1}, {1, 2}, {1, 3}, {1, 4}, {2, 5}, {2, 6},
+                    {3, 6}, {4, 6}, {5, 5}, {6, 5}, {7, 5}};
+  sk = newSKImage(200, 200);
+  setColour(sk, gray2rgba(255));
+  putByte(sk, DX_ins | 2);
+  putByte(sk, DY_ins | 6);
+  putByte(sk, DX_ins | 5);
+  putByte(sk, DY_ins | (64 - 1));
+  checkRaster(__LINE__, sk, steep, 12);
+
+  // (0,0)-(2^30,1) steps down half way, and (0,0)-(1,2^30) across half way
+  int far[][2] = {{0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0},
+                  {10, 0}, {11, 0}, {12, 0}, {13, 0}, {14, 0}, {15, 0}, {0, 1}, {0, 2}, {0, 3},
+                  {0, 4}, {0, 5}, {0, 6}, {0, 7}, {0, 8}, {0, 9}, {0, 10}, {0, 11}, {0, 12},
+                  {0, 13}, {0, 14}, {0, 15}};
+  sk = newSKImage(200, 200);
+  setColour(sk, gray2rgba(255));
+  setData(sk, 1U << 30);
+  putByte(sk, TARGETX_ins);
+  putByte(sk, DY_ins | 1);
+  putByte(sk, NONE_ins);
+  putByte(sk, TARGETX_ins);
+  putByte(sk, TARGETY_ins);
+  putByte(sk, DY_ins);
+  putByte(sk, LINE_ins);
+  setData(sk, 1U << 30);
+  putByte(sk, TARGETY_ins);
+  putByte(sk, DX_ins | 1);
+  putByte(sk, DY_ins);
+  checkRaster(__LINE__, sk, far, 31);
+}
+
+// runs are bucketed by gray, then ordered by column and row
+void testFindRuns() {
+  unsigned char grays[] = {5, 5, 1,
+                           5, 1, 1,
+                           1, 1, 5};
+  spans *r = findRuns(grays, 3, 3, 0, 3);
+
+  assert(__LINE__, r->start[1] == 0 && r->start[2] == 3 && r->start[5] == 3 && r->start[6] == 6);
+  assert(__LINE__, r->runs[0].x == 0 && r->runs[0].y == 2 && r->runs[0].last == 2);
+  assert(__LINE__, r->runs[1].x == 1 && r->runs[1].y == 1 && r->runs[1].last == 2);
+  assert(__LINE__, r->runs[2].x == 2 && r->runs[2].y == 0 && r->runs[2].last == 1);
+  assert(__LINE__, r->runs[3].x == 0 && r->runs[3].y == 0 && r->runs[3].last == 1);
+  assert(__LINE__, r->runs[5].x == 2 && r->runs[5].y == 2 && r->runs[5].last == 2);
+  assert(__LINE__, r->start[256] == 6);
+  freeRuns(r);
+}
+
+// headers with any size, extra whitespace and comments are read correctly
+void testVerifyPGM() {
+  unsigned char input[64 + 6];
+  image pgm;
+
+  strcpy((char *)input, "P5 3 2 255\n");
+  memset(input + 11, 7, 6);
+  assert(__LINE__, verifyPGM(input, 17, &pgm) && pgm.width == 3 && pgm.height == 2 && pgm.bytes == input + 11);
+  assert(__LINE__, !verifyPGM(input, 16, &pgm));
+  strcpy((char *)input, "P5\n# comment\n 3\t2 6\n");
+  memset(input + 20, 6, 6);
+  assert(__LINE__, verifyPGM(input, 26, &pgm) && pgm.width == 3 && pgm.size == 6 && pgm.bytes == input + 20);
+  input[25] = 7;
+  assert(__LINE__, !verifyPGM(input, 26, &pgm));
+  strcpy((char *)input, "P6 3 2 255\n");
+  assert(__LINE__, !verifyPGM(input, 17, &pgm));
+  strcpy((char *)input, "P5 0 2 255\n");
+  assert(__LINE__, !verifyPGM(input, 17, &pgm));
+}
+
+// a canvas other than 200x200 is declared in the sk file and survives the round trip
+void testCanvas() {
+  int width = 300, height = 70, w, h;
+  unsigned char *grays = malloc(width * height);
+  image *sk = newSKImage(width, height), *pgm = newPGMImage(width, height);
+
+  for (int i = 0; i < width * height; i++) grays[i] = (i % width) * (i / width) % 251;
+  processPGM(sk, grays);
+  sketchCanvas(sk->bytes, sk->size, &w, &h);
+  assert(__LINE__, w == width && h == height);
+  processSK(pgm, sk->bytes, sk->size);
+  assert(__LINE__, memcmp(pgm->bytes, grays, width * height) == 0);
+  sketchCanvas((unsigned char *)"\xC3\x84\xC2\x85\x84", 5, &w, &h);
+  assert(__LINE__, w == 200 && h == 200);
+  freeEverything(grays, sk);
+  free(pgm->bytes);
+  free(pgm);
+}
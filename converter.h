@@ -0,0 +1,176 @@
+// Declarations shared by the files of the pgm <-> sk converter.
+// -----------------------------------------------------------------
+#include "displaysoft.h"
+#include "command.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+
+#define PGM 1
+#define SK 0
+
+enum { DX = 0, DY = 1, TOOL = 2,
+       DATA = 3,
+       NONE = 0, LINE = 1,
+     BLOCK = 2, COLOUR = 3, TARGETX = 4, TARGETY = 5,
+     SHOW = 6, PAUSE = 7, NEXTFRAME = 8,
+     };
+
+enum { NONE_ins = 0x80, LINE_ins = 0x81, BLOCK_ins = 0x82, 
+  COLOUR_ins = 0x83, TARGETX_ins = 0x84, TARGETY_ins = 0x85,
+  SHOW_ins = 0x86, PAUSE_ins = 0x87, NEXTFRAME_ins = 0x88,
+  DATA_ins = 0xC0, DX_ins = 0x00, DY_ins = 0x40,
+  };
+
+
+typedef struct state {
+  int x, y, tx, ty;
+  unsigned int colour, data, tool;
+} state;
+
+// a run of pixels of one gray in column x, from row y to row last
+typedef struct span {
+  unsigned short x, y, last;
+} span;
+
+// all runs of an image, grouped by gray in ascending order
+// the runs of gray g are runs[start[g]] .. runs[start[g + 1] - 1]
+typedef struct spans {
+  span *runs;
+  unsigned long start[257];
+} spans;
+
+// command line options
+typedef struct options {
+  bool optimize; // use the cost-model encoder
+  bool painter; // let the cost-model encoder draw over later grays
+  bool toStdout; // stream the sk file to stdout instead of a file
+  bool quiet; // no messages for each file, as in batch mode
+  int bands; // column bands the plain encoder encodes in parallel, if above 1
+  bool stats; // print where the bytes of the sk file go
+  bool palette; // draw each gray in the rgba value of that gray with the fewest DATA bytes
+  bool blocks; // cover every gray with BLOCK fills only
+  int colours; // reduce the image to at most this many grays first, if above 0
+  int tolerance; // merge grays, moving no pixel by more than this, if above 0
+  bool progressive; // draw coarse tiles first, then the exact pixels
+} options;
+
+// the bytes of an sk file by instruction, DATA by the tool it is for
+enum { STATS_COLOUR_DATA, STATS_COLOUR, STATS_TARGET_DATA, STATS_TARGET,
+  STATS_OTHER_DATA, STATS_SWITCH, STATS_TOOL, STATS_DX, STATS_DY, STATS_KINDS };
+enum { STATS_BUCKETS = 32 };
+
+// statistics of an sk file, counted byte by byte as it is written
+typedef struct stats {
+  unsigned long bytes[STATS_KINDS];
+  unsigned long changes, distinct, slots; // colour changes, colours, hash slots
+  unsigned int *colours; // hash set of the colours, 0 for an empty slot
+  bool zero; // the colour 0 is in the set
+  unsigned long runs[STATS_BUCKETS], pixels; // lines and blocks of 2^k .. 2^(k+1)-1 pixels
+  int x, y, tx, ty, tool, pending; // drawing state, and DATA bytes not yet used
+  unsigned int data;
+} stats;
+
+typedef struct image {
+  unsigned long size; // size of the byte sequence
+  unsigned char *bytes; // dem bytes
+  int width, height; // canvas size in pixels
+  unsigned long capacity; // bytes allocated, sk images grow with putByte
+  bool stream; // full buffers are written to sink instead of growing
+  FILE *sink; // where a streamed image goes, NULL to only count the bytes
+  stats *stats; // counts every byte put, if not NULL
+  bool palette; // setColour picks the cheapest rgba value of each gray
+  unsigned long written; // bytes of a streamed image already written
+} image;
+
+// buffer size of streamed sk images
+enum { STREAM_BUFFER = 65536 };
+
+
+// I/O functions
+bool writeFile(image *thisImage, char *filename, int filetype);
+unsigned char *readFile(FILE *fp, unsigned long *length);
+
+// main functions
+bool solve(char *filename, options *opts, unsigned long sizes[2]);
+char *outputName(char *filename, char *extension, char *replacement);
+bool convert2sk(FILE *fp, char *filename, options *opts, unsigned long sizes[2]);
+bool convert2pgm(FILE *fp, char *filename, options *opts, unsigned long sizes[2]);
+void freeEverything(unsigned char *input, image *thisImage);
+
+// pgm -> sk functions
+bool verifyPGM(unsigned char *input, unsigned long length, image *pgm);
+bool headerNumber(unsigned char *input, unsigned long length, unsigned long *i, int *value);
+image *newSKImage(int width, int height);
+void putByte(image *thisImage, unsigned char b);
+image *newSKStream(int width, int height, FILE *sink);
+void flushSK(image *thisImage);
+void processPGM(image *thisImage, unsigned char *input);
+void processBand(image *thisImage, unsigned char *input, int x0, int x1);
+void drawRuns(image *thisImage, spans *r, state *s);
+bool *runDirections(spans *r, state start);
+spans *findRuns(unsigned char *input, int width, int height, int x0, int x1);
+void freeRuns(spans *r);
+void setCanvas(image *thisImage);
+void setData(image *thisImage, unsigned int value);
+int dataBytes(unsigned int value);
+void setColour(image *thisImage, unsigned int rgba);
+unsigned int cheapColour(int gray);
+unsigned int gray2rgba(unsigned int gray);
+
+// parallel conversion (batch.c)
+bool batch(char *source, options *opts);
+void processBands(image *thisImage, unsigned char *input, int bands);
+int cores();
+
+// parallel rendering and export of the frames of a sketch (frames.c)
+bool renderFrames(char *filename, options *opts);
+void startColours(program *p, unsigned int *colours);
+void renderFrame(display *d, program *p, int k, unsigned int rgba);
+bool exportAnimation(char *filename, options *opts);
+
+// coarse to fine pgm -> sk encoder (progressive.c)
+unsigned long progressivePGM(image *thisImage, unsigned char *input);
+
+// animated sk files from pgm frames (animate.c)
+int animatePGM(image *thisImage, unsigned char **frames, int n, int fps);
+bool animate(char **filenames, int n, int fps, options *opts);
+
+// byte statistics of sk files (stats.c)
+stats *newStats();
+void freeStats(stats *s);
+void countByte(stats *s, unsigned char b);
+void printStats(stats *s, FILE *log, unsigned long pgmSize, int width, int height);
+
+// lossy reduction of the grays (quantize.c)
+int quantize(unsigned char *input, unsigned long n, int colours, int tolerance);
+
+// rectangle pgm -> sk encoder (blocks.c)
+void blockPGM(image *thisImage, unsigned char *input);
+
+// optimising pgm -> sk functions (optimize.c)
+void optimizePGM(image *thisImage, unsigned char *input, options *opts);
+int chainBytes(int distance);
+int moveTo(image *out, state *s, int x, int y);
+int lineTo(image *out, state *s, int x, int y);
+int blockTo(image *out, state *s, int x, int y);
+void measureFills(unsigned short *right, unsigned short *down, int width, int x0, int y0, int x1, int y1,
+                  bool joins(void *data, unsigned long i, unsigned long j), void *data);
+void largestFill(unsigned short *right, unsigned short *down, int width, int x, int y, int *tx, int *ty);
+
+// sk -> pgm functions
+bool verifySK(unsigned char *input, unsigned long length);
+image *newPGMImage(int width, int height);
+image *mapPGM(char *filename, int width, int height);
+void unmapPGM(image *thisImage);
+void processSK(image *thisImage, unsigned char *input, unsigned long length);
+int rgba2gray(unsigned int data);
+void pasteBytes(image *thisImage, unsigned int *pixels);
+
+// from sketch.c
+void snapshot(display *d, char *filename);
+void playFrames(display *d, char *filename, int n);
+bool playFrame(display *d, char *filename, int n);
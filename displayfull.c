@@ -1,8 +1,9 @@
 // This display module provides basic graphics support for drawing built on SDL2 using a single window.
 // ----------------------------------------------------------------------------------------------------
 // Full comments on how to use the module can be found in the header file.
-#include "displayfull.h"
 #define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+#include "displayfull.h"
 #define FAILURE_CODE 1 // exit code at program failure
 
 // display object needed for a managing a graphics window
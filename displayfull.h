@@ -13,11 +13,14 @@
 // Then your function is called repeatedly until it returns true, then run() returns.
 // Finally free your data and call freeDisplay() to shut down the graphics.
 
-#include <SDL2/SDL.h>
+// Two implementations of this interface exist: displayfull.c draws into an SDL2
+// window, displaysoft.c draws into an in-memory framebuffer and needs no SDL.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // A display structure needs to be created by calling newDisplay,
 // and then needs to be passed to each of the graphics functions.
@@ -0,0 +1,402 @@
+// This display module renders into an in-memory framebuffer instead of a window.
+// ----------------------------------------------------------------------------------------------------
+// Full comments on how to use the module can be found in the header files.
+#include "displaysoft.h"
+
+// Row fills use SSE2 or AVX2 where the compiler and the running cpu support them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_FILL
+#endif
+
+#define BLACK 0x000000FF
+#define WHITE 0xFFFFFFFF
+
+// display object holding the canvas being drawn and the last shown frame
+struct display {
+  char *name;
+  int width;
+  int height;
+  unsigned int rgba;
+  unsigned int *canvas;
+  unsigned int *frame;
+  unsigned long clock; // milliseconds the viewer would have spent paused
+  void (*listener)(display *, void *);
+  void *data;
+};
+
+// Fill kernels: each fills n pixels starting at p with a single colour.
+static void fillScalar(unsigned int *p, int n, unsigned int rgba) {
+  for (int i = 0; i < n; i++) p[i] = rgba;
+}
+
+#ifdef SIMD_FILL
+__attribute__((target("sse2")))
+static void fillSSE2(unsigned int *p, int n, unsigned int rgba) {
+  __m128i v = _mm_set1_epi32(rgba);
+  int i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    _mm_storeu_si128((__m128i *)(p + i), v);
+    _mm_storeu_si128((__m128i *)(p + i + 4), v);
+    _mm_storeu_si128((__m128i *)(p + i + 8), v);
+    _mm_storeu_si128((__m128i *)(p + i + 12), v);
+  }
+  for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i *)(p + i), v);
+  for (; i < n; i++) p[i] = rgba;
+}
+
+__attribute__((target("avx2")))
+static void fillAVX2(unsigned int *p, int n, unsigned int rgba) {
+  __m256i v = _mm256_set1_epi32(rgba);
+  int i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    _mm256_storeu_si256((__m256i *)(p + i), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 8), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 16), v);
+    _mm256_storeu_si256((__m256i *)(p + i + 24), v);
+  }
+  for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i *)(p + i), v);
+  for (; i < n; i++) p[i] = rgba;
+}
+#endif
+
+// Fill n pixels starting at p with a single colour, choosing the widest kernel
+// the cpu supports. Short spans are not worth the dispatch.
+static void fillSpan(unsigned int *p, int n, unsigned int rgba) {
+  if (n < 8) { fillScalar(p, n, rgba); return; }
+#ifdef SIMD_FILL
+  if (__builtin_cpu_supports("avx2")) { fillAVX2(p, n, rgba); return; }
+  if (__builtin_cpu_supports("sse2")) { fillSSE2(p, n, rgba); return; }
+#endif
+  fillScalar(p, n, rgba);
+}
+
+static void plot(display *d, int x, int y) {
+  if (x < 0 || y < 0 || x >= d->width || y >= d->height) return;
+  d->canvas[(size_t) y * d->width + x] = d->rgba;
+}
+
+void pause(display *d, int ms) {
+  d->clock += ms;
+}
+
+int getWidth(display *d) {
+  return d->width;
+}
+
+int getHeight(display *d) {
+  return d->height;
+}
+
+char *getName(display *d) {
+  return d->name;
+}
+
+unsigned int *getCanvas(display *d) {
+  return d->canvas;
+}
+
+unsigned int *getFrame(display *d) {
+  return d->frame;
+}
+
+unsigned long getClock(display *d) {
+  return d->clock;
+}
+
+void onShow(display *d, void listener(display *, void *), void *data) {
+  d->listener = listener;
+  d->data = data;
+}
+
+// Horizontal and vertical lines are clipped spans. Any other line has a long
+// axis of a steps and a short one of b <= a. Its pixels are those of the
+// integer Bresenham loop: step i along the long axis, for i = 0 .. a, is
+// floor((2 i b + a) / 2a) along the short axis. So the steps outside the
+// canvas are skipped in one go, however far off the end points are, and the
+// position of the first step inside is found exactly in 64 bit arithmetic.
+// All lines include both end points, as SDL does.
+void line(display *d, int x0, int y0, int x1, int y1) {
+  long long dx = llabs((long long) x1 - x0), dy = llabs((long long) y1 - y0);
+  int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+
+  if (dy == 0) {
+    long long x = x0 < x1 ? x0 : x1, tx = (long long) (x0 < x1 ? x1 : x0) + 1;
+    if (y0 < 0 || y0 >= d->height) return;
+    if (x < 0) x = 0;
+    if (tx > d->width) tx = d->width;
+    if (x < tx) fillSpan(d->canvas + (size_t) y0 * d->width + x, tx - x, d->rgba);
+    return;
+  }
+  if (dx == 0) {
+    long long y = y0 < y1 ? y0 : y1, ty = (long long) (y0 < y1 ? y1 : y0) + 1;
+    if (x0 < 0 || x0 >= d->width) return;
+    if (y < 0) y = 0;
+    if (ty > d->height) ty = d->height;
+    for (unsigned int *p = d->canvas + (size_t) y * d->width + x0; y < ty; y++, p += d->width)
+      *p = d->rgba;
+    return;
+  }
+
+  bool steep = dy > dx;
+  long long a = steep ? dy : dx, b = steep ? dx : dy, along = steep ? y0 : x0, across = steep ? x0 : y0;
+  long long size = steep ? d->height : d->width, first, last;
+  int step = steep ? sy : sx, side = steep ? sx : sy;
+
+  // the steps along the long axis that fall inside the canvas
+  first = step > 0 ? -along : along - (size - 1);
+  last = step > 0 ? size - 1 - along : along;
+  if (first < 0) first = 0;
+  if (last > a) last = a;
+  if (first > last) return;
+
+  // first * b is below 2^64, and 2 * first * b + a = 2 (q 2a + r) + a
+  unsigned long long n = 2ULL * a, product = (unsigned long long) first * b;
+  unsigned long long q = product / n, r = product % n, rem = (2 * r + a) % n;
+  long long j = 2 * q + (2 * r + a) / n;
+  for (long long i = first; i <= last; i++) {
+    long long x = steep ? across + side * j : along + step * i;
+    long long y = steep ? along + step * i : across + side * j;
+    if (x >= 0 && y >= 0 && x < d->width && y < d->height) d->canvas[(size_t) y * d->width + x] = d->rgba;
+    rem += 2 * b;
+    if (rem >= n) { rem -= n; j++; }
+  }
+}
+
+// Clip the rectangle to the canvas, then fill it one row span at a time.
+void block(display *d, int x, int y, int w, int h) {
+  long long x1 = (long long) x + w, y1 = (long long) y + h;
+
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x1 > d->width) x1 = d->width;
+  if (y1 > d->height) y1 = d->height;
+  for (int row = y; row < y1 && x < x1; row++)
+    fillSpan(d->canvas + (size_t) row * d->width + x, x1 - x, d->rgba);
+}
+
+void pixel(display *d, int x, int y) {
+  plot(d, x, y);
+}
+
+void colour(display *d, int rgba) {
+  d->rgba = (unsigned int) rgba;
+}
+
+// Fill all the pixels of a canvas-sized buffer with black, a row at a time, as
+// a whole canvas of up to 65535x65535 pixels can be more than an int counts.
+static void clear(display *d, unsigned int *pixels) {
+  for (int row = 0; row < d->height; row++) fillSpan(pixels + (size_t) row * d->width, d->width, BLACK);
+}
+
+void show(display *d) {
+  size_t n = (size_t) d->width * d->height;
+
+  if (d->listener != NULL) d->listener(d, d->data);
+  memcpy(d->frame, d->canvas, n * sizeof(unsigned int));
+  clear(d, d->canvas);
+  d->clock += SHOW_DELAY;
+}
+
+display *newDisplay(char *name, int width, int height) {
+  display *d = malloc(sizeof(display));
+  size_t n = (size_t) width * height;
+
+  d->name = name;
+  d->width = width;
+  d->height = height;
+  d->canvas = malloc(n * sizeof(unsigned int));
+  d->frame = malloc(n * sizeof(unsigned int));
+  if (d->canvas == NULL || d->frame == NULL) {
+    fprintf(stderr, "Error: Out of memory for a %dx%d canvas.\n", width, height);
+    exit(1);
+  }
+  clear(d, d->canvas);
+  clear(d, d->frame);
+  d->rgba = WHITE;
+  d->clock = 0;
+  d->listener = NULL;
+  d->data = NULL;
+  return d;
+}
+
+void run(display *d, void *data, bool action(display *, void*, const char)) {
+  while (!action(d, data, 27))
+    ;
+}
+
+void freeDisplay(display *d) {
+  free(d->canvas);
+  free(d->frame);
+  free(d);
+}
+
+// ---------------------------------------------------------
+// Build with 'make displaysoft' and run ./displaysoft to test the module.
+#ifdef test_displaysoft
+
+// A replacement for the library assert function.
+static void assert(int line, bool b) {
+  if (b) return;
+  fprintf(stderr, "ERROR: The test on line %d in displaysoft.c fails.\n", line);
+  exit(1);
+}
+
+// count the pixels of the canvas with the given colour
+static int count(display *d, unsigned int rgba) {
+  int n = 0;
+  for (int i = 0; i < d->width * d->height; i++) n += d->canvas[i] == rgba;
+  return n;
+}
+
+// every fill kernel fills exactly the span, for all lengths and alignments
+static void testFill() {
+  void (*kernels[4])(unsigned int *, int, unsigned int) = {fillScalar, fillSpan};
+  unsigned int buffer[128];
+  int n = 2;
+
+#ifdef SIMD_FILL
+  if (__builtin_cpu_supports("sse2")) kernels[n++] = fillSSE2;
+  if (__builtin_cpu_supports("avx2")) kernels[n++] = fillAVX2;
+#endif
+  for (int k = 0; k < n; k++)
+    for (int offset = 0; offset < 8; offset++)
+      for (int length = 0; length < 100; length++) {
+        memset(buffer, 0, sizeof(buffer));
+        kernels[k](buffer + offset, length, 0x12345678);
+        for (int i = 0; i < 128; i++) {
+          bool inside = i >= offset && i < offset + length;
+          assert(__LINE__, buffer[i] == (inside ? 0x12345678 : 0));
+        }
+      }
+}
+
+static void testBlock() {
+  display *d = newDisplay("testBlock", 20, 10);
+  colour(d, 0xFF0000FF);
+  block(d, 2, 3, 4, 5);
+  assert(__LINE__, count(d, 0xFF0000FF) == 20);
+  assert(__LINE__, d->canvas[3 * 20 + 2] == 0xFF0000FF && d->canvas[7 * 20 + 5] == 0xFF0000FF);
+  assert(__LINE__, d->canvas[8 * 20 + 5] == BLACK && d->canvas[3 * 20 + 6] == BLACK);
+  block(d, -5, -5, 100, 100);
+  assert(__LINE__, count(d, 0xFF0000FF) == 200);
+  colour(d, WHITE);
+  block(d, 5, 5, 0, 3);
+  block(d, 5, 5, -2, 3);
+  assert(__LINE__, count(d, WHITE) == 0);
+  freeDisplay(d);
+}
+
+static void testLine() {
+  display *d = newDisplay("testLine", 20, 20);
+  line(d, 3, 2, 3, 9);
+  assert(__LINE__, count(d, WHITE) == 8);
+  assert(__LINE__, d->canvas[2 * 20 + 3] == WHITE && d->canvas[9 * 20 + 3] == WHITE);
+  show(d);
+  line(d, 0, 0, 19, 19);
+  assert(__LINE__, count(d, WHITE) == 20 && d->canvas[19 * 20 + 19] == WHITE);
+  show(d);
+  line(d, 10, 4, 0, 0);
+  assert(__LINE__, count(d, WHITE) == 11);
+  assert(__LINE__, d->canvas[0] == WHITE && d->canvas[4 * 20 + 10] == WHITE);
+  line(d, -10, 5, 30, 5);
+  assert(__LINE__, count(d, WHITE) == 31);
+  show(d);
+  line(d, 15, 20, 15, -3);
+  line(d, 10, 10, 0, 20);
+  assert(__LINE__, count(d, WHITE) == 20 + 10);
+  assert(__LINE__, d->canvas[19 * 20 + 1] == WHITE && d->canvas[10 * 20 + 10] == WHITE);
+  show(d);
+  line(d, 5, 5, 5, 5);
+  assert(__LINE__, count(d, WHITE) == 1);
+  freeDisplay(d);
+}
+
+// the Bresenham loop the closed form of line() must match, without clipping
+static void bresenham(display *d, int x0, int y0, int x1, int y1) {
+  int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+  int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy, e2;
+
+  while (true) {
+    if (x0 >= 0 && y0 >= 0 && x0 < d->width && y0 < d->height) d->canvas[y0 * d->width + x0] = d->rgba;
+    if (x0 == x1 && y0 == y1) return;
+    e2 = 2 * err;
+    if (e2 >= dy) { err += dy; x0 += sx; }
+    if (e2 <= dx) { err += dx; y0 += sy; }
+  }
+}
+
+// lines of every slope, starting and ending on or off the canvas, draw the
+// pixels of the Bresenham loop, and end points far off return at once
+static void testFarLine() {
+  display *d = newDisplay("testFarLine", 16, 12), *own = newDisplay("testFarLine", 16, 12);
+  unsigned int seed = 1;
+
+  for (int k = 0; k < 20000; k++) {
+    int p[4];
+    for (int c = 0; c < 4; c++) p[c] = (int) ((seed = seed * 1103515245u + 12345u) >> 16) % 40 - 12;
+    line(d, p[0], p[1], p[2], p[3]);
+    bresenham(own, p[0], p[1], p[2], p[3]);
+    assert(__LINE__, memcmp(d->canvas, own->canvas, 16 * 12 * sizeof(unsigned int)) == 0);
+    show(d);
+    show(own);
+  }
+  freeDisplay(own);
+
+  // a slope of 1/2 towards INT_MAX: step i is row floor((i + 1) / 2)
+  line(d, 0, 0, 2147483646, 1073741823);
+  for (int x = 0; x < 16; x++)
+    for (int y = 0; y < 12; y++) assert(__LINE__, (d->canvas[y * 16 + x] == WHITE) == (y == (x + 1) / 2));
+  show(d);
+  // from far off at both ends: the line steps down to y = 6 at x = 0
+  line(d, -2147483647 - 1, 5, 2147483647, 6);
+  assert(__LINE__, count(d, WHITE) == 16 && d->canvas[6 * 16] == WHITE && d->canvas[6 * 16 + 15] == WHITE);
+  show(d);
+  line(d, 1073741824, 1, 20, 0);
+  line(d, 3, -2147483647, 3, 2147483647);
+  assert(__LINE__, count(d, WHITE) == 12);
+  freeDisplay(d);
+}
+
+// count the calls of show
+static void shown(display *d, void *data) {
+  (*(int *)data)++;
+}
+
+static void testShow() {
+  display *d = newDisplay("testShow", 4, 4);
+  int shows = 0;
+  onShow(d, shown, &shows);
+  block(d, 0, 0, 2, 2);
+  show(d);
+  assert(__LINE__, shows == 1);
+  assert(__LINE__, count(d, WHITE) == 0);
+  assert(__LINE__, getFrame(d)[0] == WHITE && getFrame(d)[5] == WHITE && getFrame(d)[2] == BLACK);
+  freeDisplay(d);
+}
+
+// pauses and shows advance the clock by the time the viewer would wait
+static void testClock() {
+  display *d = newDisplay("testClock", 4, 4);
+  assert(__LINE__, getClock(d) == 0);
+  pause(d, 250);
+  show(d);
+  pause(d, 40);
+  assert(__LINE__, getClock(d) == 250 + SHOW_DELAY + 40);
+  freeDisplay(d);
+}
+
+int main() {
+  testFill();
+  testBlock();
+  testLine();
+  testFarLine();
+  testShow();
+  testClock();
+  printf("All tests passed\n");
+  return 0;
+}
+#endif
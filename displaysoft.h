@@ -0,0 +1,28 @@
+// This display module implements the interface of displayfull.h in software.
+// ------------------------------------------------------------------------------
+// Nothing is shown on screen. Every drawing call renders into an in-memory
+// framebuffer of packed rgba pixels, so sketches can be rendered on machines
+// without a window system. As with the SDL version, show() makes the canvas
+// visible as the current frame and then clears the canvas to black. pause()
+// returns immediately, but the time it would have waited is kept on a clock.
+// There is no keyboard, so run() calls the action once with the escape key
+// (27) pressed and returns when the action asks to quit.
+
+#include "displayfull.h"
+
+// Returns the pixels currently being drawn, width * height rgba values in rows.
+unsigned int *getCanvas(display *d);
+
+// Returns the pixels of the frame most recently made visible by show().
+unsigned int *getFrame(display *d);
+
+// The SDL display waits this many milliseconds after every show().
+enum { SHOW_DELAY = 10 };
+
+// Returns the milliseconds the viewer would have waited so far, in pause() and
+// after every show().
+unsigned long getClock(display *d);
+
+// Call listener(d, data) every time show() makes the canvas visible, before the
+// canvas is cleared. A NULL listener removes it.
+void onShow(display *d, void listener(display *, void *), void *data);
@@ -0,0 +1,223 @@
+// Offline rendering of the frames of an animated sketch, used with
+// './converter --frames file.sk', which writes file-0000.pgm, file-0001.pgm, ...
+// -----------------------------------------------------------------
+// Every frame (the commands up to a NEXTFRAME) is rendered on its own thread
+// into its own software display. Frames cannot share pixels, since the viewer
+// clears the canvas whenever it shows it, and the drawing state is reset at
+// every NEXTFRAME. The one thing a frame can take over from the frame before is
+// the drawing colour, which belongs to the display. Those colours are found in
+// a quick pass over the commands in order, before the frames are rendered.
+//
+// Animation export: './converter --export file.sk' renders the frames in order
+// from the same decoded commands, showing each at its end as the viewer does,
+// and writes every image shown to file.ppm, a stream of binary ppm images one
+// after the other. Each image has a '# delay n ms' comment with how long it
+// stays on screen: the pauses until the next show, plus the wait after every
+// show. The viewer loops, so the last image is held until the first image of
+// the next round.
+#include "converter.h"
+#include <pthread.h>
+
+// the frames of a sketch and the progress through them
+typedef struct frames {
+  program *p;
+  unsigned int *colours; // the colour every frame starts with
+  char *base; // output files are base-nnnn.pgm
+  int next, failed;
+  pthread_mutex_t lock;
+} frames;
+
+// the colour in use at the start of every frame
+// a frame that draws before it sets a colour depends on the frames before it
+void startColours(program *p, unsigned int *colours) {
+  unsigned int rgba = 0xFFFFFFFF; // the colour of a new display
+
+  for (int k = 0; k < p->nframes; k++) {
+    colours[k] = rgba;
+    for (int i = p->frames[k]; i < p->frames[k + 1]; i++)
+      if (p->commands[i].op == COLOUR_cmd) rgba = p->commands[i].data;
+  }
+}
+
+// draw frame k onto the display, which starts in the given colour,
+// leaving the canvas the viewer shows at the end of the frame and the clock
+// as far on as its pauses take it
+void renderFrame(display *d, program *p, int k, unsigned int rgba) {
+  colour(d, rgba);
+  for (int i = p->frames[k]; i < p->frames[k + 1]; i++) {
+    command *c = &p->commands[i];
+
+    switch (c->op) {
+      case COLOUR_cmd:
+        colour(d, c->data);
+        break;
+      case LINE_cmd:
+        line(d, c->x, c->y, c->tx, c->ty);
+        break;
+      case BLOCK_cmd:
+        block(d, c->x, c->y, c->tx - c->x, c->ty - c->y);
+        break;
+      case SHOW_cmd:
+        show(d);
+        break;
+      case PAUSE_cmd:
+        pause(d, c->data);
+        break;
+    }
+  }
+}
+
+// render frames until none are left
+static void *renderWorker(void *data) {
+  frames *f = data;
+  program *p = f->p;
+  display *d = newDisplay(f->base, p->width, p->height);
+  char *filename = malloc(strlen(f->base) + 16);
+
+  while (true) {
+    pthread_mutex_lock(&f->lock);
+    int k = f->next++;
+    pthread_mutex_unlock(&f->lock);
+    if (k >= p->nframes) break;
+
+    renderFrame(d, p, k, f->colours[k]);
+    sprintf(filename, "%s-%04d.pgm", f->base, k);
+    image *pgm = mapPGM(filename, p->width, p->height);
+    if (pgm == NULL) {
+      pthread_mutex_lock(&f->lock);
+      f->failed++;
+      pthread_mutex_unlock(&f->lock);
+      fprintf(stderr, "Error: Cannot write image %s.\n", filename);
+    }
+    else {
+      pasteBytes(pgm, getCanvas(d));
+      unmapPGM(pgm);
+    }
+    show(d);
+  }
+  free(filename);
+  freeDisplay(d);
+  return NULL;
+}
+
+// render every frame of the sketch file into a pgm file of its own,
+// on a thread per core
+bool renderFrames(char *filename, options *opts) {
+  FILE *fp = fopen(filename, "rb");
+  unsigned long length;
+  unsigned char *input;
+  frames f = {NULL, NULL, outputName(filename, ".sk", ""), 0, 0};
+  int threads = cores();
+  pthread_t *pool;
+
+  if (f.base == NULL) { fprintf(stderr, "Error: incorrect filetype %s.\n", filename); if (fp) fclose(fp); return false; }
+  if (fp == NULL) { fprintf(stderr, "Error: Cannot read image %s.\n", filename); free(f.base); return false; }
+  input = readFile(fp, &length);
+  if (!verifySK(input, length)) {
+    fprintf(stderr, "Error: Corrupted SK file.\n");
+    free(input);
+    free(f.base);
+    return false;
+  }
+  f.p = decodeSketch(input, length);
+  f.colours = malloc(f.p->nframes * sizeof(unsigned int));
+  startColours(f.p, f.colours);
+  if (threads > f.p->nframes) threads = f.p->nframes;
+
+  pthread_mutex_init(&f.lock, NULL);
+  pool = malloc(threads * sizeof(pthread_t));
+  for (int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, renderWorker, &f);
+  for (int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+  pthread_mutex_destroy(&f.lock);
+
+  if (!opts->quiet) printf("%d frames written to %s-0000.pgm .. %s-%04d.pgm\n", f.p->nframes, f.base, f.base, f.p->nframes - 1);
+  free(pool);
+  free(f.colours);
+  freeProgram(f.p);
+  free(f.base);
+  free(input);
+  return f.failed == 0;
+}
+
+// ---------------------------------------------------------
+
+// the images of an animation as they are shown, written one show late,
+// once it is known how long each stays on screen
+typedef struct movie {
+  FILE *out;
+  unsigned char *rgb; // the image shown last, not yet written
+  unsigned long shownAt, first; // clock of the last show and of the first one
+  int count;
+} movie;
+
+static void writeImage(movie *m, int width, int height, unsigned long delay) {
+  fprintf(m->out, "P6\n# delay %lu ms\n%d %d\n255\n", delay, width, height);
+  fwrite(m->rgb, 3, (unsigned long) width * height, m->out);
+}
+
+static void record(display *d, void *data) {
+  movie *m = data;
+  unsigned int *pixels = getCanvas(d);
+  unsigned long n = (unsigned long) getWidth(d) * getHeight(d), clock = getClock(d);
+
+  if (m->count == 0) m->first = clock;
+  else writeImage(m, getWidth(d), getHeight(d), clock - m->shownAt);
+  for (unsigned long i = 0; i < n; i++) {
+    m->rgb[3 * i] = pixels[i] >> 24;
+    m->rgb[3 * i + 1] = pixels[i] >> 16;
+    m->rgb[3 * i + 2] = pixels[i] >> 8;
+  }
+  m->shownAt = clock;
+  m->count++;
+}
+
+// render every frame of the sketch file once, in order, and write the images
+// shown, with their delays, to a ppm stream
+bool exportAnimation(char *filename, options *opts) {
+  FILE *fp = fopen(filename, "rb");
+  char *output = outputName(filename, ".sk", ".ppm");
+  unsigned long length;
+  unsigned char *input;
+  unsigned int *colours;
+  program *p;
+  display *d;
+  movie m = {NULL, NULL, 0, 0, 0};
+
+  if (output == NULL) { fprintf(stderr, "Error: incorrect filetype %s.\n", filename); if (fp) fclose(fp); return false; }
+  if (fp == NULL) { fprintf(stderr, "Error: Cannot read image %s.\n", filename); free(output); return false; }
+  input = readFile(fp, &length);
+  if (!verifySK(input, length)) {
+    fprintf(stderr, "Error: Corrupted SK file.\n");
+    free(input);
+    free(output);
+    return false;
+  }
+  if ((m.out = fopen(output, "wb")) == NULL) {
+    fprintf(stderr, "Error: Cannot write image %s.\n", output);
+    free(input);
+    free(output);
+    return false;
+  }
+  p = decodeSketch(input, length);
+  d = newDisplay(filename, p->width, p->height);
+  m.rgb = malloc(3UL * p->width * p->height);
+  colours = malloc(p->nframes * sizeof(unsigned int));
+  startColours(p, colours);
+  onShow(d, record, &m);
+  for (int k = 0; k < p->nframes; k++) {
+    renderFrame(d, p, k, colours[k]);
+    show(d);
+  }
+  // held until the viewer shows the first image again
+  writeImage(&m, p->width, p->height, getClock(d) - m.shownAt + m.first);
+
+  fclose(m.out);
+  if (!opts->quiet) printf("%d images of %d frames written to %s.\n", m.count, p->nframes, output);
+  freeDisplay(d);
+  freeProgram(p);
+  free(colours);
+  free(m.rgb);
+  free(output);
+  free(input);
+  return true;
+}
@@ -0,0 +1,455 @@
+// Optimising pgm -> sk encoder, used with './converter --optimize file.pgm'.
+// -----------------------------------------------------------------
+// The pixels of every gray are covered with whichever primitive gives the most
+// new pixels per byte: a block, a row run, a column run or a 45 degree diagonal,
+// each starting at the next uncovered pixel. Byte costs come from the same
+// routines that emit the instructions, run without an output image, so the cost
+// model always matches what is written. Every gray is visited in the order of
+// columns that costs least, and lines are drawn from whichever end is nearer.
+// With --painter, a gray may also be drawn over the pixels of grays drawn after
+// it, and the drawing order of the grays that gives the smallest file is kept.
+#include "converter.h"
+
+// write one byte, or only count it when out is NULL
+static int put(image *out, byte b) {
+  if (out != NULL) putByte(out, b);
+  return 1;
+}
+
+// number of DX or DY instructions needed to move by distance
+int chainBytes(int distance) {
+  if (distance >= 0) return (distance + 30) / 31;
+  return (31 - distance) / 32;
+}
+
+// DX or DY instructions moving by distance, at most 31 forwards or 32 backwards each
+static int chain(image *out, int opcode, int distance) {
+  int n = 0;
+
+  while (distance != 0) {
+    int step = distance > 31 ? 31 : (distance < -32 ? -32 : distance);
+    n += put(out, opcode | (step & 0x3F));
+    distance -= step;
+  }
+  return n;
+}
+
+// DATA instructions loading value, then TARGETX or TARGETY
+static int absolute(image *out, int opcode, unsigned int value) {
+  int n = 0;
+
+  for (int shift = 6 * (dataBytes(value) - 1); shift >= 0; shift -= 6)
+    n += put(out, DATA_ins | ((value >> shift) & 0x3F));
+  return n + put(out, opcode);
+}
+
+static int useTool(image *out, state *s, unsigned int tool) {
+  if (s->tool == tool) return 0;
+  s->tool = tool;
+  return put(out, NONE_ins | tool);
+}
+
+// set the x target, relatively or absolutely, whichever is shorter
+// no absolute target plus a DX step is ever shorter than one of the two
+static int targetX(image *out, state *s, int x) {
+  int n;
+
+  if (x == s->tx) return 0;
+  if (chainBytes(x - s->tx) <= dataBytes(x) + 1) n = chain(out, DX_ins, x - s->tx);
+  else n = absolute(out, TARGETX_ins, x);
+  s->tx = x;
+  return n;
+}
+
+// go to row y with DY, which also draws with the current tool, relatively or
+// absolutely, whichever is shorter
+// a single DY is needed when anything but a vertical line is drawn,
+// otherwise each DY of a chain would draw its own piece
+static int goY(image *out, state *s, int y, bool single) {
+  int distance = y - s->ty, n;
+  bool relative = !single || (-32 <= distance && distance <= 31);
+
+  // an absolute target up to 31 rows short lets the DY carry the rest,
+  // which may save DATA instructions
+  int target = y > 31 ? y - 31 : 0;
+
+  if (dataBytes(target) == dataBytes(y)) target = y;
+  if (relative && chainBytes(distance) <= dataBytes(target) + 1) {
+    n = chain(out, DY_ins, distance);
+    if (n == 0) n = put(out, DY_ins);
+  }
+  else n = absolute(out, TARGETY_ins, target) + put(out, DY_ins | ((y - target) & 0x3F));
+  s->x = s->tx;
+  s->y = s->ty = y;
+  return n;
+}
+
+// move to (x,y) without drawing
+int moveTo(image *out, state *s, int x, int y) {
+  if (x == s->x && y == s->y) return 0;
+  return useTool(out, s, NONE) + targetX(out, s, x) + goY(out, s, y, false);
+}
+
+// draw a vertical, horizontal or 45 degree line from the current position to (x,y)
+// either in one go or in pieces of 31 pixels, whichever is shorter
+int lineTo(image *out, state *s, int x, int y) {
+  int n = useTool(out, s, LINE);
+  state whole = *s, pieces = *s;
+  int wholeBytes, pieceBytes = 0;
+
+  if (x == s->x) return n + goY(out, s, y, false);
+  wholeBytes = targetX(NULL, &whole, x) + goY(NULL, &whole, y, true);
+  while (pieces.x != x || pieces.y != y) {
+    int dx = x - pieces.x, dy = y - pieces.y;
+    int step = abs(dx) > 31 ? 31 : abs(dx);
+    pieceBytes += targetX(NULL, &pieces, pieces.x + (dx > 0 ? step : -step));
+    pieceBytes += goY(NULL, &pieces, pieces.y + (dy == 0 ? 0 : (dy > 0 ? step : -step)), true);
+  }
+  if (wholeBytes <= pieceBytes) return n + targetX(out, s, x) + goY(out, s, y, true);
+  while (s->x != x || s->y != y) {
+    int dx = x - s->x, dy = y - s->y;
+    int step = abs(dx) > 31 ? 31 : abs(dx);
+    n += targetX(out, s, s->x + (dx > 0 ? step : -step));
+    n += goY(out, s, s->y + (dy == 0 ? 0 : (dy > 0 ? step : -step)), true);
+  }
+  return n;
+}
+
+// fill the block from the current position up to, but excluding, column x and row y
+int blockTo(image *out, state *s, int x, int y) {
+  return useTool(out, s, BLOCK) + targetX(out, s, x) + goY(out, s, y, true);
+}
+
+// ---------------------------------------------------------
+
+// kinds of primitives
+enum { COLUMN_run, ROW_run, DOWNRIGHT_run, DOWNLEFT_run, BLOCK_run };
+
+// a primitive starting at the seed pixel, ending at (x,y)
+// for blocks (x,y) is the excluded bottom right corner
+// reversed lines are drawn from (x,y) back to the seed
+typedef struct shape { int kind, x, y; unsigned long pixels; int bytes; bool reversed; } shape;
+
+// lengths of the runs to the right of and below every pixel of the box
+// x0 <= x < x1, y0 <= y < y1, where joins(data, i, j) tells whether the
+// neighbour j continues the run through pixel i
+void measureFills(unsigned short *right, unsigned short *down, int width, int x0, int y0, int x1, int y1,
+                  bool joins(void *data, unsigned long i, unsigned long j), void *data) {
+  for (int y = y1 - 1; y >= y0; y--)
+    for (int x = x1 - 1; x >= x0; x--) {
+      unsigned long i = (unsigned long) y * width + x, below = i + width;
+      bool joinsRight = x + 1 < x1 && joins(data, i, i + 1), joinsDown = y + 1 < y1 && joins(data, i, below);
+      right[i] = joinsRight && right[i + 1] < 65535 ? right[i + 1] + 1 : 1;
+      down[i] = joinsDown && down[below] < 65535 ? down[below] + 1 : 1;
+    }
+}
+
+// the largest block within those runs with (x,y) as top left corner, up to
+// but excluding (*tx,*ty)
+void largestFill(unsigned short *right, unsigned short *down, int width, int x, int y, int *tx, int *ty) {
+  unsigned long i = (unsigned long) y * width + x, best = 0;
+  int w = right[i];
+
+  for (int h = 1; h <= down[i]; h++) {
+    int rowWidth = right[i + (unsigned long) (h - 1) * width];
+    if (rowWidth < w) w = rowWidth;
+    if ((unsigned long) w * h > best) {
+      best = (unsigned long) w * h;
+      *tx = x + w;
+      *ty = y + h;
+    }
+  }
+}
+
+// orders of visiting the seeds of a gray: columns from the left or from the
+// right, each one top down or alternately top down and bottom up
+enum { LEFT_scan, LEFT_serpentine, RIGHT_scan, RIGHT_serpentine, SCANS };
+
+// the image being encoded
+typedef struct canvas {
+  unsigned char *input, *covered;
+  unsigned short *right, *down; // lengths of the runs the current gray may cover
+  int width, height;
+  spans *runs;
+  unsigned long *column; // column[x] is the first run of the gray in column x or after it
+  bool painter; // grays may be drawn over by later ones
+  int gray; // the gray being drawn
+  int rank[256]; // position of every gray in the drawing order
+  int box[256][4]; // bounding box of every gray, x0 y0 x1 y1 with x1 y1 excluded
+} canvas;
+
+// whether the gray being drawn may cover pixel i
+static bool usable(canvas *c, unsigned long i) {
+  int gray = c->input[i];
+
+  return gray == c->gray || (c->painter && c->rank[gray] > c->rank[c->gray]);
+}
+
+// count the uncovered pixels of the gray on a line of length pixels from (x,y) in direction (dx,dy)
+static unsigned long newOnLine(canvas *c, int x, int y, int dx, int dy, int length) {
+  unsigned long n = 0;
+
+  for (int i = 0; i < length; i++, x += dx, y += dy) {
+    unsigned long k = (unsigned long) y * c->width + x;
+    n += c->input[k] == c->gray && !c->covered[k];
+  }
+  return n;
+}
+
+// count the uncovered pixels of the gray in the block from (x,y) up to, but
+// excluding, (tx,ty), and mark them as covered if asked to
+// only the runs of the gray are visited, not the pixels it may paint over
+static unsigned long newInBlock(canvas *c, int x, int y, int tx, int ty, bool mark) {
+  unsigned long n = 0;
+
+  for (int col = x; col < tx; col++)
+    for (unsigned long i = c->column[col]; i < c->column[col + 1] && c->runs->runs[i].y < ty; i++) {
+      span *run = &c->runs->runs[i];
+      for (int row = run->y > y ? run->y : y; row <= run->last && row < ty; row++) {
+        unsigned char *covered = &c->covered[(unsigned long) row * c->width + col];
+        n += !*covered;
+        if (mark) *covered = 1;
+      }
+    }
+  return n;
+}
+
+// length of the diagonal the gray may cover from (x,y) in direction (dx,1)
+static int diagonal(canvas *c, int x, int y, int dx) {
+  int n = 0;
+
+  while (x >= 0 && x < c->width && y < c->height && usable(c, (unsigned long) y * c->width + x)) {
+    n++;
+    x += dx;
+    y++;
+  }
+  return n;
+}
+
+// the largest block the gray may cover with the seed as top left corner
+static shape largestBlock(canvas *c, int x, int y) {
+  shape b = {BLOCK_run, x + 1, y + 1, 0, 0, false};
+
+  largestFill(c->right, c->down, c->width, x, y, &b.x, &b.y);
+  return b;
+}
+
+// bytes for moving to the shape and drawing it, from the cheaper end for lines
+static void price(state *s, int x, int y, shape *sh) {
+  state forwards = *s, backwards = *s;
+  int there, back;
+
+  if (sh->kind == BLOCK_run) {
+    sh->bytes = moveTo(NULL, &forwards, x, y) + blockTo(NULL, &forwards, sh->x, sh->y);
+    return;
+  }
+  there = moveTo(NULL, &forwards, x, y) + lineTo(NULL, &forwards, sh->x, sh->y);
+  back = moveTo(NULL, &backwards, sh->x, sh->y) + lineTo(NULL, &backwards, x, y);
+  sh->reversed = back < there;
+  sh->bytes = sh->reversed ? back : there;
+}
+
+static int drawShape(image *out, state *s, int x, int y, shape *sh) {
+  if (sh->kind == BLOCK_run) return moveTo(out, s, x, y) + blockTo(out, s, sh->x, sh->y);
+  if (sh->reversed) return moveTo(out, s, sh->x, sh->y) + lineTo(out, s, x, y);
+  return moveTo(out, s, x, y) + lineTo(out, s, sh->x, sh->y);
+}
+
+// mark the pixels of the gray under the shape as covered
+static void cover(canvas *c, int x, int y, shape *sh) {
+  int dx = sh->kind == DOWNLEFT_run ? -1 : (sh->kind == ROW_run || sh->kind == DOWNRIGHT_run);
+  int dy = sh->kind != ROW_run;
+
+  if (sh->kind == BLOCK_run) {
+    newInBlock(c, x, y, sh->x, sh->y, true);
+    return;
+  }
+  for (;; x += dx, y += dy) {
+    unsigned long i = (unsigned long) y * c->width + x;
+    c->covered[i] |= c->input[i] == c->gray;
+    if (x == sh->x && y == sh->y) return;
+  }
+}
+
+// the shape with the most new pixels per byte, starting at the seed (x,y)
+static shape bestShape(canvas *c, state *s, int x, int y) {
+  unsigned long i = (unsigned long) y * c->width + x;
+  int downRight = diagonal(c, x, y, 1), downLeft = diagonal(c, x, y, -1);
+  shape options[5] = {
+    {COLUMN_run, x, y + c->down[i] - 1, newOnLine(c, x, y, 0, 1, c->down[i]), 0, false},
+    {ROW_run, x + c->right[i] - 1, y, newOnLine(c, x, y, 1, 0, c->right[i]), 0, false},
+    {DOWNRIGHT_run, x + downRight - 1, y + downRight - 1, newOnLine(c, x, y, 1, 1, downRight), 0, false},
+    {DOWNLEFT_run, x - downLeft + 1, y + downLeft - 1, newOnLine(c, x, y, -1, 1, downLeft), 0, false},
+    largestBlock(c, x, y)
+  };
+  int best = 0;
+
+  options[4].pixels = newInBlock(c, x, y, options[4].x, options[4].y, false);
+  for (int k = 0; k < 5; k++) {
+    price(s, x, y, &options[k]);
+    if (options[k].pixels * options[best].bytes > options[best].pixels * options[k].bytes)
+      best = k;
+  }
+  return options[best];
+}
+
+// whether pixel j continues the run of the current gray through pixel i
+// without painting over, these are simply the runs of equal grays
+static bool joins(void *data, unsigned long i, unsigned long j) {
+  canvas *c = data;
+
+  return c->painter ? usable(c, j) : c->input[j] == c->input[i];
+}
+
+static void measureRuns(canvas *c, int x0, int y0, int x1, int y1) {
+  measureFills(c->right, c->down, c->width, x0, y0, x1, y1, joins, c);
+}
+
+// draw the current gray, visiting the seeds in the given order of columns
+// seeds are the uncovered pixels of the gray, top down within each run
+// gives up once more than limit bytes are needed, unless limit is negative
+static int drawGray(image *out, canvas *c, state *s, int scan, int limit) {
+  spans *r = c->runs;
+  unsigned long first = r->start[c->gray], end = r->start[c->gray + 1];
+  bool fromRight = scan == RIGHT_scan || scan == RIGHT_serpentine;
+  bool serpentine = scan == LEFT_serpentine || scan == RIGHT_serpentine;
+  unsigned long next = fromRight ? end : first;
+  int n = 0;
+
+  for (int column = 0; fromRight ? next > first : next < end; column++) {
+    unsigned long lo = next, hi = next;
+    if (fromRight) while (lo > first && r->runs[lo - 1].x == r->runs[hi - 1].x) lo--;
+    else while (hi < end && r->runs[hi].x == r->runs[lo].x) hi++;
+    next = fromRight ? lo : hi;
+
+    for (unsigned long k = 0; k < hi - lo; k++) {
+      span *run = &r->runs[serpentine && column % 2 == 1 ? hi - 1 - k : lo + k];
+      for (int y = run->y; y <= run->last; y++) {
+        if (c->covered[(unsigned long) y * c->width + run->x]) continue;
+        shape sh = bestShape(c, s, run->x, y);
+        n += drawShape(out, s, run->x, y, &sh);
+        cover(c, run->x, y, &sh);
+        if (limit >= 0 && n > limit) return n;
+      }
+    }
+  }
+  return n;
+}
+
+// forget which pixels of the current gray are covered
+static void uncover(canvas *c) {
+  spans *r = c->runs;
+
+  for (unsigned long i = r->start[c->gray]; i < r->start[c->gray + 1]; i++)
+    for (int y = r->runs[i].y; y <= r->runs[i].last; y++)
+      c->covered[(unsigned long) y * c->width + r->runs[i].x] = 0;
+}
+
+// find the first run of the current gray in every column
+static void indexColumns(canvas *c) {
+  spans *r = c->runs;
+  unsigned long i = r->start[c->gray];
+
+  for (int x = 0; x <= c->width; x++) {
+    while (i < r->start[c->gray + 1] && r->runs[i].x < x) i++;
+    c->column[x] = i;
+  }
+}
+
+// encode the grays in the given order, each with its cheapest order of columns
+// the canvas starts black, so gray 0 needs no drawing when it comes first
+static void encode(image *out, canvas *c, int order[], int count) {
+  state s = {0, 0, 0, 0, 0, 0, LINE};
+
+  memset(c->covered, 0, (unsigned long) c->width * c->height);
+  for (int k = 0; k < count; k++) c->rank[order[k]] = k;
+  if (!c->painter) measureRuns(c, 0, 0, c->width, c->height);
+  if (c->width != DEFAULT_WIDTH || c->height != DEFAULT_HEIGHT) setCanvas(out);
+  for (int k = 0; k < count; k++) {
+    int *box = c->box[order[k]], best = LEFT_scan, bestBytes = -1;
+    c->gray = order[k];
+    if (k == 0 && c->gray == 0) continue;
+    indexColumns(c);
+    if (c->painter) measureRuns(c, box[0], box[1], box[2], box[3]);
+    setColour(out, gray2rgba(c->gray));
+
+    for (int scan = LEFT_scan; scan < SCANS; scan++) {
+      state trial = s;
+      int bytes = drawGray(NULL, c, &trial, scan, bestBytes);
+      uncover(c);
+      if (bestBytes < 0 || bytes < bestBytes) { best = scan; bestBytes = bytes; }
+    }
+    drawGray(out, c, &s, best, -1);
+  }
+}
+
+// bounding boxes of the grays, from their runs
+static void measureBoxes(canvas *c) {
+  spans *r = c->runs;
+
+  for (int gray = 0; gray < 256; gray++) {
+    int *box = c->box[gray];
+    if (r->start[gray] == r->start[gray + 1]) continue;
+    box[0] = r->runs[r->start[gray]].x;
+    box[2] = r->runs[r->start[gray + 1] - 1].x + 1;
+    box[1] = c->height;
+    box[3] = 0;
+    for (unsigned long i = r->start[gray]; i < r->start[gray + 1]; i++) {
+      if (r->runs[i].y < box[1]) box[1] = r->runs[i].y;
+      if (r->runs[i].last + 1 > box[3]) box[3] = r->runs[i].last + 1;
+    }
+  }
+}
+
+static long area(int *box) {
+  return (long) (box[2] - box[0]) * (box[3] - box[1]);
+}
+
+// the optimising pgm -> sk conversion
+// grays are drawn in ascending order; when painting over, grays with larger
+// bounding boxes are also tried first, and the smallest encoding is kept
+void optimizePGM(image *thisImage, unsigned char *input, options *opts) {
+  unsigned long n = (unsigned long) thisImage->width * thisImage->height;
+  canvas c = {input, malloc(n), malloc(n * sizeof(unsigned short)),
+    malloc(n * sizeof(unsigned short)), thisImage->width, thisImage->height,
+    findRuns(input, thisImage->width, thisImage->height, 0, thisImage->width), malloc((thisImage->width + 1) * sizeof(unsigned long)), false};
+  int ascending[256], largest[256], count = 0;
+
+  measureBoxes(&c);
+  for (int gray = 0; gray < 256; gray++)
+    if (c.runs->start[gray] < c.runs->start[gray + 1]) ascending[count++] = gray;
+  for (int k = 0; k < count; k++) {
+    int j = k;
+    for (; j > 0 && area(c.box[largest[j - 1]]) < area(c.box[ascending[k]]); j--) largest[j] = largest[j - 1];
+    largest[j] = ascending[k];
+  }
+
+  if (!opts->painter) encode(thisImage, &c, ascending, count);
+  else {
+    // the trials are kept in memory and only the smallest goes out
+    image *best = NULL;
+    for (int k = 0; k < 3; k++) {
+      image *trial = newSKImage(c.width, c.height);
+      trial->palette = thisImage->palette;
+      c.painter = k > 0;
+      encode(trial, &c, k == 2 ? largest : ascending, count);
+      if (best == NULL || trial->size < best->size) {
+        image *kept = best;
+        best = trial;
+        trial = kept;
+      }
+      if (trial != NULL) {
+        free(trial->bytes);
+        free(trial);
+      }
+    }
+    for (unsigned long i = 0; i < best->size; i++) putByte(thisImage, best->bytes[i]);
+    free(best->bytes);
+    free(best);
+  }
+  freeRuns(c.runs);
+  free(c.column);
+  free(c.covered);
+  free(c.right);
+  free(c.down);
+}
@@ -0,0 +1,117 @@
+// Progressive pgm -> sk encoder, used with './converter --progressive file.pgm'.
+// -----------------------------------------------------------------
+// The image is drawn coarse to fine, so that any prefix of the file already
+// draws a recognisable picture. The first pass fills square tiles, about an
+// eighth of the shorter side, with the mean gray of each. Every later pass
+// halves the tiles, down to 4x4, and fills those whose mean is visibly off the
+// tile drawn before them. A pass draws a gray at a time, and neighbouring tiles
+// of a row in the same gray are one block. The last pass draws the exact pixels
+// with the run encoder, leaving out the pixels the tiles already got right.
+//
+// There is no SHOW between the passes: the viewer clears the canvas whenever it
+// shows it, so every pass would have to draw the whole picture again, and the
+// still image of an sk file is the first one shown, which would be the coarsest.
+// The passes draw over each other instead, and the picture is shown once.
+#include "converter.h"
+
+enum { FINEST = 4, VISIBLE = 12 }; // the smallest tile, the smallest change refined
+
+// the tiles of one pass and the canvas the passes so far have drawn
+typedef struct tiling {
+  unsigned char *input, *canvas;
+  int width, height, size, columns, rows;
+  short *grays; // the gray every tile is filled with, -1 if it is left as it is
+} tiling;
+
+// choose the gray of every tile of the given size, where its mean differs
+// visibly from the canvas below it, which is a single gray
+static void chooseTiles(tiling *t, int size, bool first) {
+  t->size = size;
+  t->columns = (t->width + size - 1) / size;
+  t->rows = (t->height + size - 1) / size;
+  for (int row = 0; row < t->rows; row++)
+    for (int col = 0; col < t->columns; col++) {
+      int x0 = col * size, y0 = row * size;
+      int x1 = x0 + size < t->width ? x0 + size : t->width, y1 = y0 + size < t->height ? y0 + size : t->height;
+      unsigned long sum = 0, below = t->canvas[(unsigned long) y0 * t->width + x0];
+      for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++) sum += t->input[(unsigned long) y * t->width + x];
+      int mean = (int) ((2 * sum + (unsigned long) (x1 - x0) * (y1 - y0)) / (2UL * (x1 - x0) * (y1 - y0)));
+      bool drawn = first ? mean != 0 : abs(mean - (int) below) >= VISIBLE;
+      t->grays[row * t->columns + col] = drawn ? mean : -1;
+    }
+}
+
+// fill the chosen tiles, a gray at a time, and paint them onto the canvas
+static void drawTiles(image *thisImage, tiling *t, state *s) {
+  bool used[256] = {false};
+
+  for (int i = 0; i < t->rows * t->columns; i++) if (t->grays[i] >= 0) used[t->grays[i]] = true;
+  for (int gray = 0; gray < 256; gray++) {
+    bool coloured = false;
+
+    if (!used[gray]) continue;
+
+    for (int row = 0; row < t->rows; row++)
+      for (int col = 0; col < t->columns; col++) {
+        int last = col, y0 = row * t->size, x0 = col * t->size;
+        if (t->grays[row * t->columns + col] != gray) continue;
+        while (last + 1 < t->columns && t->grays[row * t->columns + last + 1] == gray) last++;
+        int x1 = (last + 1) * t->size < t->width ? (last + 1) * t->size : t->width;
+        int y1 = y0 + t->size < t->height ? y0 + t->size : t->height;
+
+        if (!coloured) setColour(thisImage, gray2rgba(gray)), coloured = true;
+        s->colour = gray;
+        moveTo(thisImage, s, x0, y0);
+        blockTo(thisImage, s, x1, y1);
+        for (int y = y0; y < y1; y++) memset(t->canvas + (unsigned long) y * t->width + x0, gray, x1 - x0);
+        col = last;
+      }
+  }
+}
+
+// trim every run to the pixels the canvas does not show yet, dropping the
+// runs it already shows
+static void trimRuns(spans *r, unsigned char *input, unsigned char *canvas, int width) {
+  unsigned long n = 0;
+
+  for (int gray = 0; gray < 256; gray++) {
+    unsigned long first = r->start[gray], end = r->start[gray + 1];
+    r->start[gray] = n;
+    for (unsigned long i = first; i < end; i++) {
+      span run = r->runs[i];
+      unsigned long top = (unsigned long) run.y * width + run.x, bottom = (unsigned long) run.last * width + run.x;
+      while (run.y <= run.last && canvas[top] == input[top]) run.y++, top += width;
+      while (run.last > run.y && canvas[bottom] == input[bottom]) run.last--, bottom -= width;
+      if (run.y <= run.last) r->runs[n++] = run;
+    }
+  }
+  r->start[256] = n;
+}
+
+// the progressive pgm -> sk conversion
+// returns the bytes of the tile passes, before the exact pixels
+unsigned long progressivePGM(image *thisImage, unsigned char *input) {
+  unsigned long n = (unsigned long) thisImage->width * thisImage->height, start, coarse;
+  tiling t = {input, calloc(n, 1), thisImage->width, thisImage->height, 0, 0, 0, NULL};
+  int shorter = t.width < t.height ? t.width : t.height, size = FINEST;
+  state s = {0, 0, 0, 0, 0, 0, LINE};
+
+  if (t.width != DEFAULT_WIDTH || t.height != DEFAULT_HEIGHT) setCanvas(thisImage);
+  start = thisImage->written + thisImage->size;
+  t.grays = malloc(((unsigned long) (t.width + FINEST - 1) / FINEST) * ((t.height + FINEST - 1) / FINEST) * sizeof(short));
+  while (size * 16 <= shorter) size *= 2;
+  for (bool first = true; size >= FINEST; size /= 2, first = false) {
+    chooseTiles(&t, size, first);
+    drawTiles(thisImage, &t, &s);
+  }
+  coarse = thisImage->written + thisImage->size - start;
+
+  spans *r = findRuns(input, t.width, t.height, 0, t.width);
+  trimRuns(r, input, t.canvas, t.width);
+  drawRuns(thisImage, r, &s);
+  freeRuns(r);
+  free(t.canvas);
+  free(t.grays);
+  return coarse;
+}
@@ -0,0 +1,150 @@
+// Lossy reduction of the grays of a pgm file before it is encoded, used with
+// './converter --colours n file.pgm' and './converter --tolerance t file.pgm'.
+// -----------------------------------------------------------------
+// Every gray costs a colour change, and every border between two grays ends a
+// run, so fewer grays give fewer and longer runs. --tolerance t merges the grays
+// into as few groups as possible in which every pixel moves by at most t.
+// --colours n then picks the n grays with the least squared error over all
+// pixels, an exact k-means on the histogram by dynamic programming, as the
+// grays lie on a line. Each group is drawn in its mean gray. With both options,
+// the groups of --colours are kept within the tolerance, and there are as many
+// more of them as the tolerance needs.
+#include "converter.h"
+
+// the grays in use and how many pixels have each
+typedef struct histogram {
+  int grays[256], count;
+  unsigned long pixels[256];
+} histogram;
+
+static void makeHistogram(histogram *h, unsigned long all[256]) {
+  h->count = 0;
+  for (int gray = 0; gray < 256; gray++)
+    if (all[gray] > 0) {
+      h->grays[h->count] = gray;
+      h->pixels[h->count++] = all[gray];
+    }
+}
+
+// the mean gray of the grays first..last of the histogram
+static int meanGray(histogram *h, int first, int last) {
+  double sum = 0, pixels = 0;
+
+  for (int k = first; k <= last; k++) {
+    sum += (double) h->grays[k] * h->pixels[k];
+    pixels += h->pixels[k];
+  }
+  return (int) round(sum / pixels);
+}
+
+// the gray of the group of the grays first..last: their mean, moved if
+// needed so that no gray of the group moves by more than t, if t > 0
+static int groupGray(histogram *h, int first, int last, int t) {
+  int gray = meanGray(h, first, last);
+
+  if (t > 0 && gray > h->grays[first] + t) gray = h->grays[first] + t;
+  if (t > 0 && gray < h->grays[last] - t) gray = h->grays[last] - t;
+  return gray;
+}
+
+// merge grays no more than 2t apart, moving no pixel by more than t
+// scanning up from the darkest gray gives the fewest groups, which are counted
+static int mergeGrays(histogram *h, unsigned char map[256], int t) {
+  int groups = 0;
+
+  for (int first = 0, last; first < h->count; first = last + 1, groups++) {
+    last = first;
+    while (last + 1 < h->count && h->grays[last + 1] - h->grays[first] <= 2 * t) last++;
+    int gray = groupGray(h, first, last, t);
+    for (int k = first; k <= last; k++) map[h->grays[k]] = gray;
+  }
+  return groups;
+}
+
+// prefix sums of the pixels of the histogram, their grays and squared grays
+typedef struct sums {
+  double pixels[257], sum[257], squares[257];
+} sums;
+
+// squared error of the grays i..j around the gray of their group, or -1 if
+// they cannot be one group within the tolerance t
+static double spread(histogram *h, sums *p, int i, int j, int t) {
+  double pixels = p->pixels[j + 1] - p->pixels[i], sum = p->sum[j + 1] - p->sum[i];
+  double gray = sum / pixels;
+
+  if (t > 0 && h->grays[j] - h->grays[i] > 2 * t) return -1;
+  if (t > 0 && gray > h->grays[i] + t) gray = h->grays[i] + t;
+  if (t > 0 && gray < h->grays[j] - t) gray = h->grays[j] - t;
+  return p->squares[j + 1] - p->squares[i] - 2 * gray * sum + gray * gray * pixels;
+}
+
+// split the grays into n groups of consecutive grays with the least squared
+// error, moving no gray by more than t if t > 0, which needs at least as many
+// groups as mergeGrays makes
+// error[k][j] is the least error of the grays 0..j in k + 1 groups, -1 if
+// there is none, and start[k][j] the first gray of the last of those groups
+static void groupGrays(histogram *h, unsigned char map[256], int n, int t) {
+  double (*error)[256] = malloc(n * sizeof(*error));
+  int (*start)[256] = malloc(n * sizeof(*start));
+  sums p;
+
+  p.pixels[0] = p.sum[0] = p.squares[0] = 0;
+  for (int k = 0; k < h->count; k++) {
+    double g = h->grays[k], pixels = h->pixels[k];
+    p.pixels[k + 1] = p.pixels[k] + pixels;
+    p.sum[k + 1] = p.sum[k] + pixels * g;
+    p.squares[k + 1] = p.squares[k] + pixels * g * g;
+  }
+
+  for (int j = 0; j < h->count; j++) {
+    error[0][j] = spread(h, &p, 0, j, t);
+    start[0][j] = 0;
+  }
+  for (int k = 1; k < n; k++)
+    for (int j = k; j < h->count; j++) {
+      error[k][j] = -1;
+      for (int i = k; i <= j; i++) {
+        double last = spread(h, &p, i, j, t), e = error[k - 1][i - 1] + last;
+        if (last < 0 || error[k - 1][i - 1] < 0) continue;
+        if (error[k][j] < 0 || e < error[k][j]) {
+          error[k][j] = e;
+          start[k][j] = i;
+        }
+      }
+    }
+
+  for (int k = n - 1, last = h->count - 1; last >= 0; k--) {
+    int first = start[k][last], gray = groupGray(h, first, last, t);
+    for (int i = first; i <= last; i++) map[h->grays[i]] = gray;
+    last = first - 1;
+  }
+  free(error);
+  free(start);
+}
+
+// reduce the grays of the n pixels in place to at most colours grays, if
+// colours > 0, each moved by at most tolerance, if tolerance > 0
+// with both, the tolerance wins: there are more colours if it needs them
+// returns the largest change of any pixel
+int quantize(unsigned char *input, unsigned long n, int colours, int tolerance) {
+  unsigned char map[256];
+  unsigned long all[256] = {0};
+  histogram h;
+  int worst = 0, groups;
+
+  for (unsigned long i = 0; i < n; i++) all[input[i]]++;
+  for (int gray = 0; gray < 256; gray++) map[gray] = gray;
+  makeHistogram(&h, all);
+  groups = tolerance > 0 ? mergeGrays(&h, map, tolerance) : h.count;
+
+  // too many groups: the fewest the tolerance allows, grouped with the least error
+  if (colours > 0 && groups > colours) {
+    for (int gray = 0; gray < 256; gray++) map[gray] = gray;
+    groupGrays(&h, map, tolerance > 0 ? groups : colours, tolerance);
+  }
+
+  for (unsigned long i = 0; i < n; i++) input[i] = map[input[i]];
+  for (int gray = 0; gray < 256; gray++)
+    if (all[gray] > 0 && abs(map[gray] - gray) > worst) worst = abs(map[gray] - gray);
+  return worst;
+}
@@ -1,40 +1,42 @@
 // Basic program skeleton for a Sketch File (.sk) Viewer
 #include "displayfull.h"
 #include "sketch.h"
+#include "command.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 // ---------------------------------------------------------------------------
 
-long int binaryLength(display *d) {
+// read the whole sketch file once and decode it into the state
+// the file is read in growing chunks, so that it can also be a pipe
+void loadSketch(state *s, char *filename) {
   FILE *fp;
-  long length;
-
-  fp = fopen(getName(d), "rb");
-  fseek(fp, 0, SEEK_END);
-  length = ftell(fp);
-  fclose(fp);
+  unsigned long length = 0, capacity = 4096;
+  unsigned char *bytes = (unsigned char *)malloc(capacity);
+  size_t got;
+
+  fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  if (fp == NULL) { fprintf(stderr, "Error: Cannot read sketch %s.\n", filename); exit(1); }
+  while ((got = fread(bytes + length, 1, capacity - length, fp)) > 0) {
+    length += got;
+    if (length == capacity) bytes = (unsigned char *)realloc(bytes, capacity *= 2);
+  }
+  if (fp != stdin) fclose(fp);
 
-  return length;
+  s->program = decodeSketch(bytes, length);
+  s->start = 0;
+  free(bytes);
 }
 
-unsigned char *binaryString(display *d) {
-  FILE *fp;
-  long length;
-  unsigned char *s;
-
-  fp = fopen(getName(d), "rb");
-  length = binaryLength(d);
-  s = (unsigned char *)malloc(length);
-  fseek(fp, 0, SEEK_SET);
-  fread(s, length, 1, fp);
-  fclose(fp);
-
-  return s;
+int seekFrame(state *s, int n) {
+  if (n < 0 || n >= s->program->nframes) return -1;
+  s->start = s->program->frames[n];
+  return 0;
 }
 
-void reset(state *s, unsigned char *v) {
+void reset(state *s) {
   s->x = 0;
   s->y = 0;
   s->tx = 0;
@@ -42,24 +44,10 @@ void reset(state *s, unsigned char *v) {
   s->tool = LINE;
   s->data = 0;
   s->end = false;
-
-  free(v);
 }
 
 void obeyNextFrame(display *d, state *s) {
-  unsigned char *v;
-  long int length = binaryLength(d);
-  bool found = false;
-
-  v = binaryString(d);
-  for (int i = 0; i < length && !found; ++i)
-    if (v[i] == 0x88 && s->start < i) {
-      s->start = i;
-      found = true;
-      s->end = true;
-    }
-
-  free(v);
+  s->end = true;
 }
 
 void obeyTOOL(display *d, state *s, byte op) {
@@ -125,6 +113,30 @@ void obeyDATA(display *d, state *s, byte op) {
   s->data = (s->data << 6) | (operand & 0x3F);
 }
 
+// execute a decoded command, a FRAME_cmd ends the current frame
+void obeyCommand(display *d, state *s, command *c) {
+  switch (c->op) {
+    case COLOUR_cmd:
+      colour(d, c->data);
+      break;
+    case LINE_cmd:
+      line(d, c->x, c->y, c->tx, c->ty);
+      break;
+    case BLOCK_cmd:
+      block(d, c->x, c->y, c->tx - c->x, c->ty - c->y);
+      break;
+    case SHOW_cmd:
+      show(d);
+      break;
+    case PAUSE_cmd:
+      pause(d, c->data);
+      break;
+    case FRAME_cmd:
+      obeyNextFrame(d, s);
+      break;
+  }
+}
+
 // ---------------------------------------------------------------------------
 
 
@@ -134,29 +146,17 @@ state *newState() {
   state *new;
 
   new = (state *)malloc(sizeof(state));
-  *new = (state) {0, 0, 0, 0, LINE, 0, 0, false};
+  *new = (state) {0, 0, 0, 0, LINE, 0, 0, false, NULL};
 
   return new;
 }
 
 // Release all memory associated with the drawing state
 void freeState(state *s) {
+  if (s->program != NULL) freeProgram(s->program);
   free(s);
 }
 
-// Extract an opcode from a byte (two most significant bits).
-int getOpcode(byte b) {
-  return b >> 6;
-}
-
-// Extract an operand (-32..31) from the rightmost 6 bits of a byte.
-int getOperand(byte b) {
-  int val = b & 0x3F;
-
-  if (val >> 5) val = val | 0xFFFFFFC0; // extend sign
-  return val;
-}
-
 // Execute the next byte of the command sequence.
 void obey(display *d, state *s, byte op) {
   int opcode;
@@ -184,7 +184,8 @@ void obey(display *d, state *s, byte op) {
 // this function is called.
 bool processSketch(display *d, void *data, const char pressedKey) {
 
-    //TO DO: OPEN, PROCESS/DRAW A SKETCH FILE BYTE BY BYTE, THEN CLOSE IT
+    //NOTE: THE SKETCH FILE IS READ AND DECODED ONCE ON THE FIRST CALL AND KEPT IN
+    //      THE STATE, EVERY LATER CALL REPLAYS THE DECODED COMMANDS FROM MEMORY
     //NOTE: CHECK DATA HAS BEEN INITIALISED... if (data == NULL) return (pressedKey == 27);
     //NOTE: TO GET ACCESS TO THE DRAWING STATE USE... state *s = (state*) data;
     //NOTE: TO GET THE FILENAME... char *filename = getName(d);
@@ -194,35 +195,62 @@ bool processSketch(display *d, void *data, const char pressedKey) {
   state *s = (state *) data;
   if (data == NULL) return (pressedKey == 27);
 
-  unsigned char *v;
-  long int length = binaryLength(d);
-  v = binaryString(d);
+  if (s->program == NULL) loadSketch(s, getName(d));
 
-  int i = s->start != 0 ? s->start + 1 : 0; 
-  for (; i < length && !(s->end); ++i)
-    obey(d, s, v[i]);
+  program *p = s->program;
+  int i = s->start;
+  for (; i < p->size && !(s->end); ++i)
+    obeyCommand(d, s, &p->commands[i]);
 
-  if (s->end == false) s->start = 0;
+  s->start = s->end ? i : 0;
   show(d);
-  reset(s, v);
+  reset(s);
   return (pressedKey == 27);
 }
 
-// View a sketch file in a 200x200 pixel window given the filename
+// Draw the first n frames of a sketch file onto a display in order, as the
+// viewer plays them, showing each
+void playFrames(display *d, char *filename, int n) {
+  state *s = newState();
+  loadSketch(s, filename);
+  for (int k = 0; k < n; k++) processSketch(d, s, 0);
+  freeState(s);
+}
+
+// Draw frame n of a sketch file alone onto a display and show it, seeking to
+// it without drawing the frames before it, or report that there is no frame n
+bool playFrame(display *d, char *filename, int n) {
+  state *s = newState();
+  loadSketch(s, filename);
+  bool found = seekFrame(s, n) == 0;
+  if (found) processSketch(d, s, 0);
+  else fprintf(stderr, "Error: no frame %d (sketch has %d frames).\n", n, s->program->nframes);
+  freeState(s);
+  return found;
+}
+
+// Draw the first frame of a sketch file onto a display and show it
+void snapshot(display *d, char *filename) {
+  playFrames(d, filename, 1);
+}
+
+// View a sketch file in a window of its canvas size given the filename
 void view(char *filename) {
-  display *d = newDisplay(filename, 200, 200);
   state *s = newState();
+  loadSketch(s, filename);
+  display *d = newDisplay(filename, s->program->width, s->program->height);
   run(d, s, processSketch);
   freeState(s);
   freeDisplay(d);
 }
 
 // Include a main function only if we are not testing (make sketch),
-// otherwise use the main function of the test.c file (make test).
+// otherwise use the main function of the test.c file (make test)
+// or of converter.c, whose tests compare its output with the viewer.
 #ifndef TESTING
 int main(int n, char *args[n]) {
   if (n != 2) { // return usage hint if not exactly one argument
-    printf("Use ./sketch file\n");
+    printf("Use ./sketch file, or ./sketch - to read the sketch from stdin\n");
     exit(1);
   } else view(args[1]); // otherwise view sketch file in argument
   return 0;
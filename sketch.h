@@ -13,8 +13,11 @@ enum { NONE = 0, LINE = 1, // basic
        SHOW = 6, PAUSE = 7, NEXTFRAME = 8 // advanced
      };
 
-// Data structure holding the drawing state (DO NOT CHANGE)
-typedef struct state { int x, y, tx, ty; unsigned char tool; unsigned int start, data; bool end;} state;
+// Data structure holding the drawing state. The sketch file is decoded once
+// into program and every frame is then replayed from memory; start is the
+// index of the first command of the frame drawn next.
+typedef struct state { int x, y, tx, ty; unsigned char tool; unsigned int start, data; bool end;
+                       struct program *program; } state;
 
 // -----------------------------------------------------------------
 // DO NOT CHANGE ANY OF THE DECLARATIONS BELOW
@@ -44,5 +47,28 @@ void obey(display *d, state *s, byte op);
 // this function is called.
 bool processSketch(display *d, void *data, const char pressedKey);
 
-// View a sketch file in a 200x200 pixel window given the filename
+// View a sketch file in a window of its canvas size (200x200 unless the file
+// declares another size) given the filename, or - for stdin
 void view(char *filename);
+
+// -----------------------------------------------------------------
+// Resident sketch files and random access to their frames
+// -----------------------------------------------------------------
+
+// Read a sketch file, or stdin for -, and decode it into the drawing state.
+void loadSketch(state *s, char *filename);
+
+// Make the next call of processSketch draw frame n (counting from 0) of the
+// loaded sketch file. A file with k NEXTFRAME bytes has k + 1 frames.
+// Returns -1, leaving the state as it is, if there is no frame n.
+int seekFrame(state *s, int n);
+
+// Draw the first frame of a sketch file onto a display and show it.
+void snapshot(display *d, char *filename);
+
+// Draw the first n frames of a sketch file onto a display in order and show each.
+void playFrames(display *d, char *filename, int n);
+
+// Seek to frame n of a sketch file and draw that frame alone onto a display, showing it.
+// Returns false, drawing nothing, if there is no frame n.
+bool playFrame(display *d, char *filename, int n);
@@ -0,0 +1,130 @@
+// Where the bytes of an sk file go, for './converter --stats file.pgm'.
+// -----------------------------------------------------------------
+// The bytes are counted as putByte writes them, so the statistics cost no
+// extra pass and work when the file is streamed. Every byte is counted by its
+// instruction: DATA bytes are charged to the tool that consumes them (COLOUR,
+// TARGETX or TARGETY), and the drawing state is followed as the viewer follows
+// it, so that every line and block drawn goes into a histogram of its pixels.
+#include "converter.h"
+
+stats *newStats() {
+  stats *s = calloc(1, sizeof(stats));
+
+  s->tool = LINE;
+  return s;
+}
+
+void freeStats(stats *s) {
+  free(s->colours);
+  free(s);
+}
+
+// add a colour to the set of colours used, an open addressing hash table
+static void addColour(stats *s, unsigned int rgba) {
+  if (2 * (s->distinct + 1) > s->slots) {
+    unsigned int *old = s->colours;
+    unsigned long slots = s->slots;
+    s->slots = slots == 0 ? 256 : 2 * slots;
+    s->colours = calloc(s->slots, sizeof(unsigned int));
+    s->distinct = s->zero;
+    for (unsigned long i = 0; i < slots; i++) if (old[i] != 0) addColour(s, old[i]);
+    free(old);
+  }
+  // 0 marks an empty slot, so the colour 0 is kept aside
+  if (rgba == 0) { s->distinct += !s->zero; s->zero = true; return; }
+  unsigned long i = (rgba * 2654435761u) & (s->slots - 1);
+  while (s->colours[i] != 0 && s->colours[i] != rgba) i = (i + 1) & (s->slots - 1);
+  if (s->colours[i] == 0) { s->colours[i] = rgba; s->distinct++; }
+}
+
+// the pixels of a line or block drawn from (x,y) to (tx,ty)
+static void addDraw(stats *s) {
+  long w = (long) s->tx - s->x, h = (long) s->ty - s->y, pixels;
+  int bucket = 0;
+
+  // lines include both end points, blocks only have pixels when drawn forwards
+  if (s->tool == LINE) pixels = (labs(w) > labs(h) ? labs(w) : labs(h)) + 1;
+  else pixels = w > 0 && h > 0 ? w * h : 0;
+  if (pixels == 0) return;
+  while (bucket < STATS_BUCKETS - 1 && pixels >> (bucket + 1) != 0) bucket++;
+  s->runs[bucket]++;
+  s->pixels += pixels;
+}
+
+// count a byte written to the sk file
+void countByte(stats *s, unsigned char b) {
+  int operand = b & 0x3F;
+
+  if (operand >= 32 && (b >> 6) != DATA && (b >> 6) != TOOL) operand -= 64;
+  switch (b >> 6) {
+    case DATA:
+      s->data = (s->data << 6) | operand;
+      s->pending++;
+      return;
+    case DX:
+      s->bytes[STATS_DX]++;
+      s->tx += operand;
+      break;
+    case DY:
+      s->bytes[STATS_DY]++;
+      s->ty += operand;
+      if (s->tool == LINE || s->tool == BLOCK) addDraw(s);
+      s->x = s->tx;
+      s->y = s->ty;
+      break;
+    case TOOL:
+      if (operand == COLOUR) {
+        s->bytes[STATS_COLOUR]++;
+        s->bytes[STATS_COLOUR_DATA] += s->pending;
+        s->changes++;
+        addColour(s, s->data);
+      }
+      else if (operand == TARGETX || operand == TARGETY) {
+        s->bytes[STATS_TARGET]++;
+        s->bytes[STATS_TARGET_DATA] += s->pending;
+        if (operand == TARGETX) s->tx = s->data;
+        else s->ty = s->data;
+      }
+      else if (operand <= BLOCK) {
+        s->bytes[STATS_SWITCH]++;
+        s->bytes[STATS_OTHER_DATA] += s->pending;
+        s->tool = operand;
+      }
+      else {
+        // PAUSE takes its DATA, the other tools ignore theirs
+        s->bytes[STATS_TOOL]++;
+        s->bytes[STATS_OTHER_DATA] += s->pending;
+        if (operand == NEXTFRAME) s->x = s->y = s->tx = s->ty = 0, s->tool = LINE;
+      }
+      s->data = 0;
+      s->pending = 0;
+      return;
+  }
+  // DATA before a DX or DY is never used
+  s->bytes[STATS_OTHER_DATA] += s->pending;
+  s->pending = 0;
+}
+
+// print the statistics of the sk file of a width x height image,
+// converted from a pgm file of the given size
+void printStats(stats *s, FILE *log, unsigned long pgmSize, int width, int height) {
+  char *names[STATS_KINDS] = {"DATA for COLOUR", "COLOUR", "DATA for TARGETX/Y", "TARGETX/Y",
+                              "other DATA", "NONE/LINE/BLOCK", "other TOOL", "DX", "DY"};
+  unsigned long total = 0, pixels = (unsigned long) width * height;
+  unsigned long colourBytes = s->bytes[STATS_COLOUR_DATA] + s->bytes[STATS_COLOUR];
+
+  // DATA at the very end is never used either
+  s->bytes[STATS_OTHER_DATA] += s->pending;
+  s->pending = 0;
+  for (int k = 0; k < STATS_KINDS; k++) total += s->bytes[k];
+  fprintf(log, "%lu bytes for %lu pixels: %.4f bytes per pixel, %.2f%% of the pgm file.\n",
+    total, pixels, (double) total / pixels, 100.0 * total / pgmSize);
+  for (int k = 0; k < STATS_KINDS; k++)
+    fprintf(log, "  %-19s %10lu bytes %6.2f%%\n", names[k], s->bytes[k], total ? 100.0 * s->bytes[k] / total : 0);
+  fprintf(log, "%lu colours, %lu colour changes: %.2f bytes per change, %.1f bytes per colour.\n",
+    s->distinct, s->changes, s->changes ? (double) colourBytes / s->changes : 0,
+    s->distinct ? (double) colourBytes / s->distinct : 0);
+  fprintf(log, "%lu pixels drawn by lines and blocks of\n", s->pixels);
+  for (int k = 0; k < STATS_BUCKETS; k++)
+    if (s->runs[k] != 0) fprintf(log, "  %8lu .. %-8lu pixels: %lu\n", 1UL << k, (2UL << k) - 1, s->runs[k]);
+}